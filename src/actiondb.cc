@@ -18,6 +18,7 @@
 
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/map.hpp>
@@ -197,6 +198,8 @@ template<class Archive> void StrokeSet::serialize(Archive & ar, G_GNUC_UNUSED un
 }
 
 template<class Archive> void StrokeInfo::load(Archive & ar, const unsigned int version) {
+	std::vector<Stroke> all;
+	bool keep_first = false;
 	if (version >= 4) {
 		ar & stroke;
 		ar & action;
@@ -205,7 +208,10 @@ template<class Archive> void StrokeInfo::load(Archive & ar, const unsigned int v
 		StrokeSet strokes;
 		ar & strokes;
 		
-		if(strokes.size() && *strokes.begin()) stroke = std::move(**strokes.begin());
+		/* Easystroke allowed several strokes for one action, keep all of them;
+		 * the first one stays the main one (as before samples were supported) */
+		for(const auto& x : strokes) if(x && !x->trivial()) all.push_back(std::move(*x));
+		if(!all.empty()) keep_first = true;
 		
 		boost::shared_ptr<Action> action2;
 		ar & action2;
@@ -225,8 +231,82 @@ template<class Archive> void StrokeInfo::load(Archive & ar, const unsigned int v
 		}
 		if(!action) action = action2->clone();
 	}
-	if (version == 0) return;
-	ar & name;
+	if (version >= 1) ar & name;
+	if (version >= 5) {
+		unsigned int n;
+		ar & n;
+		samples.resize(n);
+		for(unsigned int i = 0; i < n; i++) ar & samples[i];
+		if (version >= 6) ar & spread;
+		/* older versions did not save spread; the main stroke was
+		 * saved first, so only the spread to it has to be computed */
+		else if (n) {
+			all.push_back(std::move(stroke));
+			for(auto& x : samples) all.push_back(std::move(x));
+			keep_first = true;
+		}
+	}
+	if(!all.empty()) set_samples(std::move(all), keep_first);
+}
+
+/* difference between two samples, the larger one of the two directions */
+static double sample_diff(const Stroke& a, const Stroke& b) {
+	double score1, score2;
+	if(Stroke::compare(a, b, score1) < 0) score1 = 0.0;
+	if(Stroke::compare(b, a, score2) < 0) score2 = 0.0;
+	return 1.0 - std::min(score1, score2);
+}
+
+void StrokeInfo::set_samples(std::vector<Stroke>&& all, bool keep_first) {
+	clear_samples();
+	all.erase(std::remove_if(all.begin(), all.end(), [](const Stroke& x) { return x.trivial(); }), all.end());
+	size_t n = all.size();
+	if(!n) return;
+	
+	std::vector<double> diff(n * n, 0.0);
+	size_t medoid = 0;
+	if(keep_first) for(size_t j = 1; j < n; j++) diff[j] = sample_diff(all[0], all[j]);
+	else {
+		for(size_t i = 0; i < n; i++) for(size_t j = i + 1; j < n; j++)
+			diff[i * n + j] = diff[j * n + i] = sample_diff(all[i], all[j]);
+		double min_total = -1.0;
+		for(size_t i = 0; i < n; i++) {
+			double total = 0.0;
+			for(size_t j = 0; j < n; j++) total += diff[i * n + j];
+			if(min_total < 0.0 || total < min_total) {
+				min_total = total;
+				medoid = i;
+			}
+		}
+	}
+	
+	stroke = std::move(all[medoid]);
+	for(size_t j = 0; j < n; j++) if(j != medoid) {
+		spread = std::max(spread, diff[medoid * n + j]);
+		samples.push_back(std::move(all[j]));
+	}
+}
+
+void StrokeInfo::add_sample(Stroke&& s) {
+	std::vector<Stroke> all;
+	all.push_back(std::move(stroke));
+	for(auto& x : samples) all.push_back(std::move(x));
+	all.push_back(std::move(s));
+	set_samples(std::move(all));
+}
+
+void StrokeInfo::copy_samples(const Stroke& s, const std::vector<Stroke>* other, double other_spread) {
+	clear_samples();
+	stroke = s.clone();
+	if(other) for(const auto& x : *other) samples.push_back(x.clone());
+	spread = other_spread;
+}
+
+void StrokeInfo::move_samples(StrokeInfo& other) {
+	stroke = std::move(other.stroke);
+	samples = std::move(other.samples);
+	spread = other.spread;
+	other.clear_samples();
 }
 
 class Unique {
@@ -251,6 +331,42 @@ ActionListDiff<false>* ActionListDiff<false>::add_child(std::string name, bool a
 	return child;
 }
 
+template<>
+const std::string& ActionListDiff<false>::get_stroke_name(unique_t id) const {
+	auto it = added.find(id);
+	if(it != added.end() && it->second.name != "") return it->second.name;
+	//!! TODO: check for non-null parent ??
+	return parent->get_stroke_name(id);
+}
+
+template<>
+std::map<stroke_id, const StrokeInfo*> ActionListDiff<false>::get_stroke_infos() const {
+	std::map<stroke_id, const StrokeInfo*> strokes = parent ? parent->get_stroke_infos() : std::map<stroke_id, const StrokeInfo*>();
+	for(const auto& x : deleted) strokes.erase(x);
+	for(const auto& x : added) if(!x.second.stroke.trivial()) strokes[x.first] = &x.second;
+	return strokes;
+}
+
+template<>
+void ActionListDiff<false>::get_match_entries(std::vector<MatchEntry>& out) const {
+	out.clear();
+	for(const auto& x : get_stroke_infos()) {
+		MatchEntry e;
+		e.id = x.first;
+		e.info = x.second;
+		/* note: unlike get_stroke_action(), this allows a missing action */
+		for(const ActionListDiff* list = this; list; list = list->parent) {
+			auto it = list->added.find(x.first);
+			if(it != list->added.end() && it->second.action) {
+				e.action = it->second.action.get();
+				break;
+			}
+		}
+		e.name = &get_stroke_name(x.first);
+		out.push_back(e);
+	}
+}
+
 void ActionDB::convert_actionlist(ActionListDiff<false>& dst, ActionListDiff<true>& src,
 		std::unordered_map<Unique*, stroke_id>& mapping, std::unordered_set<Unique*>& extra_unique) {
 	for(Unique* x : src.order) {
@@ -332,6 +448,7 @@ template<class Archive> void ActionDB::load(Archive & ar, const unsigned int ver
 
 char const * const ActionDB::wstroke_actions_versions[3] = { "actions-wstroke-2", "actions-wstroke", nullptr };
 char const * const ActionDB::easystroke_actions_versions[5] = { "actions-0.5.6", "actions-0.4.1", "actions-0.4.0", "actions", nullptr };
+char const * const ActionDB::compiled_suffix = ".bin";
 
 bool ActionDB::read(const std::string& config_file_name, bool readonly) {
 	clear();
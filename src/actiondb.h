@@ -19,9 +19,12 @@
 #include <map>
 #include <set>
 #include <list>
+#include <array>
+#include <algorithm>
 #include <unordered_set>
 #include <unordered_map>
 #include <string>
+#include <functional>
 #include <type_traits>
 #include <glibmm.h>
 #include <glibmm/i18n.h>
@@ -44,6 +47,8 @@ class View;
 class Plugin;
 class Ranking;
 class Touchpad;
+class ThreadPool;
+class StrokeIndex;
 
 
 class ActionVisitor {
@@ -308,12 +313,41 @@ public:
 	
 	std::unique_ptr<Action> action;
 	Stroke stroke;
+	/* Additional samples of the same gesture. If there are any, stroke
+	 * is usually the medoid of all samples (the one with the smallest
+	 * total difference to the others), and spread is the largest
+	 * difference between it and another sample (as 1 - score, in both
+	 * directions). The score of a new stroke with any sample is then
+	 * estimated to be at most its score with stroke plus spread. This is
+	 * only a heuristic: matching costs do not satisfy the triangle
+	 * inequality, so a sample can score higher than this estimate. */
+	std::vector<Stroke> samples;
+	double spread = 0.0;
 	std::string name;
+	
+	/* Set the samples of this gesture (replacing any existing ones) and
+	 * choose the medoid among them; if keep_first is true, the first one
+	 * is kept as stroke instead (spread is computed from it). Choosing
+	 * the medoid compares all pairs of samples, so this is only done when
+	 * samples are added (not when loading or copying a gesture). */
+	void set_samples(std::vector<Stroke>&& all, bool keep_first = false);
+	/* Add one more sample, choosing the medoid again. */
+	void add_sample(Stroke&& s);
+	/* Copy the stroke, all samples and the spread from another gesture. */
+	void copy_samples(const Stroke& s, const std::vector<Stroke>* other, double other_spread);
+	/* Move the stroke and all samples from another gesture. */
+	void move_samples(StrokeInfo& other);
+	/* Remove the stroke and all samples. */
+	void clear_samples() { stroke = Stroke(); samples.clear(); spread = 0.0; }
 };
-BOOST_CLASS_VERSION(StrokeInfo, 4)
+BOOST_CLASS_VERSION(StrokeInfo, 6)
+/* version 5: additional samples (the main stroke is saved first)
+ * version 6: also save spread, so that it is not computed when loading */
 
 struct StrokeRow {
 	const Stroke* stroke = nullptr;
+	const std::vector<Stroke>* samples = nullptr; /* set along with stroke */
+	double spread = 0.0; /* set along with stroke */
 	const std::string* name = nullptr;
 	const Action* action = nullptr;
 	bool deleted = false;
@@ -322,18 +356,162 @@ struct StrokeRow {
 	bool action_overwrite = false;
 };
 
+typedef uint32_t stroke_id;
+
+/* A gesture that can be matched in an ActionListDiff, with the changes
+ * inherited from its parents already applied (see get_match_table()). */
+struct MatchEntry {
+	stroke_id id = 0;
+	const StrokeInfo* info = nullptr; /* stroke and samples to match against */
+	Action* action = nullptr;
+	const std::string* name = nullptr;
+};
+
+/* Result of matching a stroke (see ActionListDiff::handle()). This does
+ * not allocate memory: names are not copied (they point to the ones
+ * stored in the ActionDB), and only the best top_k matches are kept, in
+ * a fixed-size array. */
 class Ranking {
-	int x, y;
 public:
-	const Stroke *stroke, *best_stroke;
-	Action* action;
-	double score;
-	std::string name;
-	std::multimap<double, std::pair<std::string, const Stroke*> > r;
+	/* a template that matched the stroke */
+	struct Match {
+		double score = 0.0;
+		stroke_id id = 0;
+		const Stroke* stroke = nullptr; /* the sample with this score */
+		const std::string* name = nullptr;
+	};
+	static constexpr unsigned int max_top_k = 16;
+	
+	const Stroke *stroke = nullptr, *best_stroke = nullptr;
+	Action* action = nullptr;
+	double score = 0.0;
+	stroke_id id = 0; /* ID of the best match */
+	const std::string* name = nullptr; /* name of the best match */
+	/* number of matches to keep (at most max_top_k); set this before
+	 * matching if the other matches are needed, not only the best one */
+	unsigned int top_k = 0;
+	/* number of templates compared and skipped based on their signature */
+	unsigned int n_compared = 0;
+	unsigned int n_pruned = 0;
+	/* set if matching stopped early (see MatchOptions::stop_early);
+	 * n_skipped templates were not considered at all in this case */
+	bool truncated = false;
+	unsigned int n_skipped = 0;
+	
+	const std::string& get_name() const {
+		static const std::string empty;
+		return name ? *name : empty;
+	}
+	/* the best matches by decreasing score (ties by ID) */
+	const Match* begin() const { return top.data(); }
+	const Match* end() const { return top.data() + n_top; }
+	unsigned int size() const { return n_top; }
+	void clear_matches() { n_top = 0; }
+	/* add m if it is among the best top_k matches so far */
+	void add_match(const Match& m) {
+		unsigned int k = std::min(top_k, max_top_k);
+		unsigned int i = n_top;
+		while(i > 0 && (m.score > top[i-1].score || (m.score == top[i-1].score && m.id < top[i-1].id))) {
+			if(i < k) top[i] = top[i-1];
+			i--;
+		}
+		if(i >= k) return;
+		top[i] = m;
+		if(n_top < k) n_top++;
+	}
+	
+private:
+	std::array<Match, max_top_k> top;
+	unsigned int n_top = 0;
 };
 
 
-typedef uint32_t stroke_id;
+/* Counts how often each gesture was recognized, so that the most used
+ * ones can be compared first. Counts decay exponentially over time: they
+ * are halved after half_life seconds (no decay if it is zero). */
+class UsageStats {
+	public:
+		void set_half_life(double seconds) { half_life = seconds; }
+		void record(stroke_id id);
+		/* current (decayed) count for id */
+		double get(stroke_id id) const;
+		void reset() { counts.clear(); }
+		bool empty() const { return counts.empty(); }
+		/* Read / write counts to a text file. Reading replaces all
+		 * counts; false is returned if the file cannot be read. Writing
+		 * is done to a temporary file (file_name + ".tmp") first, which
+		 * is then renamed, so the file is never left incomplete. */
+		bool read(const std::string& file_name);
+		bool write(const std::string& file_name) const;
+		/* Order in which the given templates should be compared (as
+		 * indices into entries): most used first, keeping the original
+		 * order if counts are the same. tmp is used as temporary storage;
+		 * this does not allocate memory if out and tmp are reused. */
+		void order(const std::vector<MatchEntry>& entries, std::vector<unsigned int>& out, std::vector<double>& tmp) const;
+		/* Same, but sorting entries in place; they must be sorted by ID
+		 * before. tmp is used as temporary storage, so that this does not
+		 * allocate memory if it is reused between calls. */
+		void sort(std::vector<const MatchEntry*>& entries, std::vector<std::pair<double, const MatchEntry*>>& tmp) const;
+		
+	private:
+		struct Count {
+			double count = 0.0;
+			double time = 0.0; /* when count was last updated */
+		};
+		std::unordered_map<stroke_id, Count> counts;
+		double half_life = 0.0;
+		double decayed(const Count& c, double now) const;
+};
+
+
+/* Options that control how strokes are matched by ActionListDiff::handle() */
+struct MatchOptions {
+	Stroke::Engine engine = Stroke::Engine::Exact;
+	/* Skipping templates based on their signature before comparing:
+	 *  - None: compare all templates;
+	 *  - Exact: skip templates whose lower bound on the cost shows that
+	 *    they cannot score higher than the best match so far (only with
+	 *    Engine::Exact, the result is the same as without skipping);
+	 *  - Heuristic: also skip templates whose signature_distance() is
+	 *    larger than prefilter_tolerance (this can change the result). */
+	enum class Prefilter { None, Exact, Heuristic };
+	Prefilter prefilter = Prefilter::Exact;
+	double prefilter_tolerance = 0.6;
+	/* if given, templates are compared in parallel using this pool */
+	ThreadPool* pool = nullptr;
+	/* If given, templates whose estimated cost (StrokeIndex::estimate())
+	 * is larger than index_tolerance are skipped. This is approximate,
+	 * i.e. it can change the result. */
+	const StrokeIndex* index = nullptr;
+	double index_tolerance = 0.15;
+	/* If coarse_top_k > 0, templates are first compared using their
+	 * coarse versions (Stroke::compare_coarse()), and only the best
+	 * coarse_top_k ones, and the ones with a coarse score within
+	 * coarse_margin of the best, are compared fully. This is approximate. */
+	unsigned int coarse_top_k = 0;
+	double coarse_margin = 0.1;
+	/* If given, templates are compared starting with the most used ones,
+	 * so that others can be rejected earlier. This does not change the
+	 * result: ties are still resolved in favor of the smaller ID. */
+	const UsageStats* usage = nullptr;
+	/* If stop_early is true, the remaining templates are not compared
+	 * once a template with a score of at least stop_score is found, that
+	 * is also better by at least stop_margin than all others compared
+	 * so far. This is approximate: a later template could score higher.
+	 * If a thread pool is used, this is done separately for each part of
+	 * the templates processed in parallel (so the result does not depend
+	 * on the timing of the threads).
+	 * IncrementalMatcher compares templates in a different order, so its
+	 * result can differ from handle() in this case. */
+	bool stop_early = false;
+	double stop_score = 0.95;
+	double stop_margin = 0.1;
+	/* Note: independently of these options, the additional samples of a
+	 * gesture are only compared if its main stroke scores within the
+	 * spread of the samples to the best match (see StrokeInfo). This is
+	 * approximate, since a sample could still score higher. */
+};
+
 class Unique;
 class ActionDB;
 
@@ -363,6 +541,10 @@ class ActionListDiff {
 	std::map<unique_t, StrokeInfo> added;
 	std::list<unique_t> order; // only for old version (uptr == true)
 	std::list<ActionListDiff> children;
+	/* all gestures available here, see ActionDB::build_match_tables() */
+	std::vector<MatchEntry> match_table;
+	bool has_match_table = false;
+	void get_match_entries(std::vector<MatchEntry>& out) const;
 
 	void remove(unique_t id, bool really, ActionListDiff* skip = nullptr);
 public:
@@ -398,7 +580,13 @@ public:
 	bool resettable(unique_t id) const { return parent && (added.count(id) || deleted.count(id)) && parent->contains(id); }
 
 	void set_action(unique_t id, std::unique_ptr<Action>&& action) { added[id].action = std::move(action); }
-	void set_stroke(unique_t id, Stroke&& stroke) { added[id].stroke = std::move(stroke); }
+	void set_stroke(unique_t id, Stroke&& stroke) {
+		StrokeInfo& si = added[id];
+		si.clear_samples();
+		si.stroke = std::move(stroke);
+	}
+	/* add a new sample to a stroke that is set in this list (see has_stroke()) */
+	void add_sample(unique_t id, Stroke&& stroke) { added[id].add_sample(std::move(stroke)); }
 	void set_name(unique_t id, std::string name) { added[id].name = std::move(name); }
 	bool contains(unique_t id) const {
 		if (deleted.count(id))
@@ -414,13 +602,26 @@ public:
 	}
 	ActionListDiff *add_child(std::string name, bool app);
 
+	/* Note: const member functions do not modify any state, so they can
+	 * be called from multiple threads concurrently, and the strokes
+	 * returned here can be compared concurrently (see Stroke::compare()). */
 	std::map<unique_t, const Stroke*> get_strokes() const;
+	/* same, but with all samples of each gesture */
+	std::map<unique_t, const StrokeInfo*> get_stroke_infos() const;
 	std::set<unique_t> get_ids(bool include_deleted) const;
+	/* All gestures that can be matched here, sorted by ID. If the table
+	 * was built by ActionDB::build_match_tables(), it is returned
+	 * directly; otherwise, it is created in tmp. */
+	const std::vector<MatchEntry>& get_match_table(std::vector<MatchEntry>& tmp) const;
  	int count_actions() const {
 		if(parent) return get_ids(false).size();
 		else return added.size();
 	}
-	Action* handle(const Stroke& s, Ranking* r) const;
+	/* Find the best match for s among the gestures available here. With
+	 * the default options, all gestures are considered, but additional
+	 * samples are skipped based on the spread heuristic (see StrokeInfo),
+	 * so the result is approximate for gestures with several samples. */
+	Action* handle(const Stroke& s, Ranking* r, const MatchOptions& opts = MatchOptions()) const;
 	
 	template<class CB>
 	void visit_all_actions(CB&& cb) const {
@@ -431,6 +632,99 @@ BOOST_CLASS_VERSION(ActionListDiff<true>, 1)
 BOOST_CLASS_VERSION(ActionListDiff<false>, 1)
 
 
+/* Matches a stroke against the templates in an ActionListDiff while it
+ * is being drawn. Each call to update() compares the current version of
+ * the stroke to as many templates as possible within a time budget;
+ * once all templates are compared, the stroke is only matched again
+ * after its length grew by min_growth (relative to the version matched
+ * before). If the stroke did not change after the last update, finish()
+ * only needs to compare the remaining templates (if any). Otherwise,
+ * finish() only compares the final stroke to the best finish_candidates
+ * templates for the last version of the stroke that update() finished
+ * matching; it compares the remaining templates as well only if there
+ * are no such templates, or none of them matches the final stroke.
+ * If the stroke did not change, the result is the same as with
+ * ActionListDiff::handle() (except when additional samples of a gesture
+ * are compared in one case but not in the other, since this depends on
+ * the best score found before). Otherwise, it is approximate: a template
+ * that did not match the earlier version well can still be the best
+ * match for the final stroke. Ranking only includes templates that were
+ * compared and not rejected early. */
+class IncrementalMatcher {
+	public:
+		/* Templates are compared one by one on the calling thread, so
+		 * MatchOptions::pool, index and coarse_top_k are not used here;
+		 * if any of them is set, use ActionListDiff::handle() instead. */
+		static bool supports(const MatchOptions& opts);
+		void start(const ActionListDiff<false>* list, const MatchOptions& opts);
+		void reset();
+		bool active() const { return list != nullptr; }
+		/* spend at most budget_us microseconds on matching ps (this can be
+		 * exceeded by the time needed for comparing one template) */
+		void update(const Stroke::PreStroke& ps, int budget_us);
+		static constexpr double min_growth = 0.1;
+		static constexpr unsigned int finish_candidates = 8;
+		/* get the result for the final version of the stroke */
+		Action* finish(const Stroke::PreStroke& ps, Ranking* r);
+		
+	private:
+		const ActionListDiff<false>* list = nullptr;
+		MatchOptions opts;
+		std::vector<MatchEntry> templates;
+		std::vector<unsigned int> order; /* order to compare templates in */
+		std::vector<double> sort_keys; /* temporary storage for sorting order */
+		
+		/* current version of the stroke being matched */
+		Stroke::PreStroke points;
+		Stroke stroke;
+		bool have_stroke = false;
+		double length = 0.0; /* length of the stroke when it was started */
+		size_t next = 0; /* position in order */
+		size_t end = 0; /* templates are compared until this position in order */
+		/* number of templates at the start of order that matched the
+		 * last version of the stroke that was compared to all templates */
+		size_t n_candidates = 0;
+		std::vector<double> scores; /* score of each template, or -1 if rejected */
+		std::vector<const Stroke*> matched; /* sample of each template with this score */
+		double best_score = 0.0;
+		double second_score = 0.0; /* best score of the other templates */
+		int best = -1;
+		unsigned int n_compared = 0;
+		unsigned int n_pruned = 0;
+		
+		void start_stroke(const Stroke::PreStroke& ps);
+		void step();
+		/* true if there is no need to compare more templates */
+		bool done() const;
+};
+
+
+/* Index of all strokes in an ActionDB, storing the matching cost of
+ * each stroke to a few pivot strokes (chosen among them to be far from
+ * each other). This is used to estimate the cost between a new stroke
+ * and each template from the costs to the pivots only.
+ * Note: matching costs do not satisfy the triangle inequality, so the
+ * estimate is not a real lower bound, and skipping templates based on
+ * it is approximate. Strokes are identified by their address, so the
+ * same index works for all (inherited) stroke sets in the ActionDB. */
+class StrokeIndex {
+	public:
+		bool empty() const { return pivots.empty(); }
+		size_t size() const { return pivots.size(); }
+		/* Calculate the costs from s to each pivot. */
+		std::vector<double> pivot_costs(const Stroke& s) const;
+		void pivot_costs(const Stroke& s, std::vector<double>& out) const;
+		/* Estimated cost between a stroke with the given costs to the
+		 * pivots and t; returns 0 if t is not in the index. */
+		double estimate(const std::vector<double>& costs, const Stroke* t) const;
+		
+	private:
+		friend class ActionDB;
+		std::vector<const Stroke*> pivots;
+		std::unordered_map<const Stroke*, std::vector<double>> costs;
+};
+
+
 class ActionDB {
 private:
 	/* input / output via boost */
@@ -450,6 +744,16 @@ private:
 	std::map<std::string, ActionListDiff<false>*> apps;
 	ActionListDiff<false> root;
 	std::unordered_set<std::string> exclude_apps;
+	StrokeIndex index;
+	
+	/* Storage for the contents of a compiled file (see read_compiled()):
+	 * the ActionListDiffs only have match tables that refer to these, and
+	 * the strokes use the mapped file directly (compiled_map unmaps it
+	 * when the last reference to it is gone). */
+	std::shared_ptr<const void> compiled_map;
+	std::vector<StrokeInfo> compiled_infos;
+	std::vector<std::unique_ptr<Action>> compiled_actions;
+	std::vector<std::string> compiled_strings;
 	
 	/* Storage of stroke_ids.
 	 * We store all stroke_ids in the order they should appear in the
@@ -508,9 +812,64 @@ public:
 	/* During read(), the version of the archive is stored. It can be retrieved here
 	 * and used to decide if a conversion from an older took place during loading. */
 	unsigned int get_read_version() const { return read_version; }
+	/* Save the information needed for matching strokes in a binary format
+	 * that can be used by read_compiled(). source_file_name is the text
+	 * archive that was just saved by write(): the result is only used as
+	 * long as that file is not changed. Throws an exception on failure. */
+	void write_compiled(const std::string& file_name, const std::string& source_file_name) const;
+	/* Read a file created by write_compiled() (only for matching, the
+	 * result is read-only and cannot be saved). The file is mapped into
+	 * memory and the strokes use it in place, so this is much faster than
+	 * read(). Returns false if the file is missing, invalid, or older than
+	 * source_file_name, in which case read() should be used instead.
+	 * Note: this will clear any existing actions first. */
+	bool read_compiled(const std::string& file_name, const std::string& source_file_name);
 	/* Merge or replace the contents of this ActionDB with the given other one. */
 	void merge_actions(ActionDB&& other);
 	void overwrite_actions(ActionDB&& other);
+	/* Build an index with the given number of pivots over all strokes
+	 * (only for matching, should be called after read()). */
+	void build_index(unsigned int n_pivots);
+	const StrokeIndex& get_index() const { return index; }
+	/* Resolve the gestures available in each ActionListDiff (including
+	 * the ones inherited from its parents) into a flat table, so that
+	 * matching does not need to look at the parents (only for matching,
+	 * should be called after read(); the tables are not updated if this
+	 * ActionDB is modified later). If this was read by read_compiled(),
+	 * the tables are already there. */
+	void build_match_tables();
+	
+	/* Called regularly by the functions below with the fraction of the
+	 * work done (between 0 and 1); if it returns false, they stop early
+	 * and return what they have found so far. */
+	using progress_func = std::function<bool(double)>;
+	
+	/* Replace all strokes with simplified versions that have a score
+	 * of at least min_score when compared to the original ones (see
+	 * Stroke::simplify()). Returns the number of points removed. */
+	unsigned int compact_strokes(double min_score);
+	/* The same in two steps: get_compacted() only computes the simplified
+	 * strokes without modifying anything (so it can run on a separate
+	 * thread), and set_compacted() stores them. Nothing should be added or
+	 * removed in between. */
+	struct CompactedStrokes {
+		/* the main stroke first, then the samples of each gesture changed */
+		std::map<const StrokeInfo*, std::vector<Stroke>> strokes;
+		unsigned int removed = 0;
+	};
+	CompactedStrokes get_compacted(double min_score, const progress_func& progress = nullptr) const;
+	void set_compacted(CompactedStrokes&& compacted);
+	/* Pair of strokes that are very similar to each other. */
+	struct DuplicateStrokes {
+		const ActionListDiff<false>* list;
+		stroke_id id1, id2;
+		double score;
+	};
+	/* Find pairs of strokes that match each other (in both directions)
+	 * with a score of at least min_score among the strokes used in the
+	 * same ActionListDiff. Each pair is reported only for the list where
+	 * at least one of the strokes is set. */
+	std::vector<DuplicateStrokes> find_duplicates(double min_score, const progress_func& progress = nullptr) const;
 	
 	
 	/******************************************************************
@@ -520,6 +879,12 @@ public:
 		auto i = apps.find(wm_class);
 		return i == apps.end() ? nullptr : i->second;
 	}
+	/* gestures to match for the given app: its own list if it has one,
+	 * the root otherwise */
+	const ActionListDiff<false> *get_matcher(const std::string& wm_class) const {
+		const ActionListDiff<false> *list = get_action_list(wm_class);
+		return list ? list : &root;
+	}
 	
 	const ActionListDiff<false> *get_root() const { return &root; }
 	ActionListDiff<false> *get_root() { return &root; }
@@ -576,6 +941,8 @@ public:
 	/* Config file names */
 	static char const * const wstroke_actions_versions[3];
 	static char const * const easystroke_actions_versions[5];
+	/* appended to the config file name for the compiled version */
+	static char const * const compiled_suffix;
 };
 BOOST_CLASS_VERSION(ActionDB, 5)
 
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __ACTIONDB_COMPILED_H__
+#define __ACTIONDB_COMPILED_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Layout of the compiled configuration written by ActionDB::write_compiled()
+ * and read by ActionDB::read_compiled(). This only contains what is needed
+ * for matching strokes: the gestures available in each app / group
+ * (resolved from the changes in the ActionListDiffs), the strokes with all
+ * values precomputed, the actions and the excluded apps.
+ * The file starts with a CompiledHeader, followed by the sections listed
+ * there, each one aligned to 8 bytes. All references are indices into a
+ * section (or offsets in the chars section), so the file can be mapped
+ * anywhere in memory and used in place. Values are stored in the native
+ * format, the file is not read on a different architecture. */
+
+struct CompiledSection {
+	uint64_t offset; /* from the start of the file */
+	uint64_t count; /* number of elements */
+};
+
+struct CompiledHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /* compiled_byte_order, as written on this architecture */
+	uint64_t size; /* size of the whole file, a multiple of 8 */
+	uint64_t checksum; /* compiled_checksum() of everything after the header */
+	/* size and modification time (in nanoseconds) of the text archive
+	 * this was created from; if these differ, this file is out of date */
+	int64_t source_size;
+	int64_t source_mtime;
+	CompiledSection chars; /* char: NUL-terminated strings */
+	CompiledSection strings; /* uint32_t: offset of each string in chars */
+	CompiledSection data; /* double: strokes, see stroke_get_data() */
+	CompiledSection strokes; /* CompiledStroke */
+	CompiledSection infos; /* CompiledInfo */
+	CompiledSection actions; /* CompiledAction */
+	CompiledSection lists; /* CompiledList */
+	CompiledSection entries; /* CompiledEntry */
+	CompiledSection exclude; /* uint32_t: index of each excluded app in strings */
+};
+
+struct CompiledStroke {
+	uint32_t n; /* number of points */
+	uint32_t reserved;
+	uint64_t data; /* index of the first element in data */
+};
+
+/* a gesture with its samples (see StrokeInfo) */
+struct CompiledInfo {
+	uint32_t stroke; /* index in strokes; the samples follow it there */
+	uint32_t n_samples;
+	double spread;
+};
+
+struct CompiledAction {
+	enum Type : uint32_t { COMMAND, SEND_KEY, SEND_TEXT, SCROLL, IGNORE, BUTTON, GLOBAL, VIEW, PLUGIN, TOUCHPAD };
+	uint32_t type;
+	uint32_t mods;
+	uint32_t arg1; /* key, button or type (for Global, View and Touchpad) */
+	uint32_t arg2; /* number of fingers for Touchpad */
+	uint32_t str; /* index in strings (for Command, SendText and Plugin) */
+	uint32_t reserved;
+};
+
+/* ActionListDiffs are stored in a pre-order of the tree (starting with
+ * the root), so the parent of each one comes before it */
+struct CompiledList {
+	uint32_t name; /* index in strings */
+	uint32_t parent; /* index in lists, compiled_none for the root */
+	uint32_t app;
+	uint32_t n_entries;
+	uint64_t first_entry; /* index in entries */
+};
+
+/* one gesture available in a list (see MatchEntry), sorted by ID */
+struct CompiledEntry {
+	uint32_t id;
+	uint32_t info; /* index in infos */
+	uint32_t action; /* index in actions, compiled_none if there is no action */
+	uint32_t name; /* index in strings */
+};
+
+static constexpr char compiled_magic[8] = { 'W', 'S', 'T', 'R', 'O', 'K', 'E', 'C' };
+static constexpr uint32_t compiled_version = 1;
+static constexpr uint32_t compiled_byte_order = 0x01020304;
+static constexpr uint32_t compiled_none = UINT32_MAX;
+
+/* FNV-1a hash, done on 64-bit words instead of bytes to be faster */
+static inline uint64_t compiled_checksum(const uint64_t* data, size_t n) {
+	uint64_t h = 14695981039346656037ULL;
+	for(size_t i = 0; i < n; i++) {
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+#endif
+
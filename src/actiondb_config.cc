@@ -16,9 +16,12 @@
  */
 
 #include "actiondb.h"
+#include "actiondb_compiled.h"
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <cstring>
+#include <sys/stat.h>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/map.hpp>
@@ -36,6 +39,10 @@ template<class Archive> void StrokeInfo::save(Archive & ar, G_GNUC_UNUSED const
 	ar & stroke;
 	ar & action;
 	ar & name;
+	unsigned int n = samples.size();
+	ar & n;
+	for(const Stroke& x : samples) ar & x;
+	ar & spread;
 }
 
 template<class Archive> void ActionDB::save(Archive & ar, G_GNUC_UNUSED unsigned int version) const {
@@ -57,6 +64,202 @@ void ActionDB::write(const std::string& config_file_name) const {
 	printf("Saved actions.\n");
 }
 
+/* Collects the contents of the sections for write_compiled() */
+class CompiledWriter : public ActionVisitor {
+	public:
+		std::string chars;
+		std::vector<uint32_t> strings;
+		std::vector<double> data;
+		std::vector<CompiledStroke> strokes;
+		std::vector<CompiledInfo> infos;
+		std::vector<CompiledAction> actions;
+		std::vector<CompiledList> lists;
+		std::vector<CompiledEntry> entries;
+		std::vector<uint32_t> exclude;
+		
+		/* strings are stored only once */
+		uint32_t add_string(const std::string& str) {
+			auto it = string_ids.find(str);
+			if(it != string_ids.end()) return it->second;
+			uint32_t id = strings.size();
+			strings.push_back(chars.size());
+			chars.append(str.c_str(), str.size() + 1);
+			string_ids.emplace(str, id);
+			return id;
+		}
+		
+		void add_info(const StrokeInfo* info) {
+			CompiledInfo x;
+			x.stroke = strokes.size();
+			x.n_samples = info->samples.size();
+			x.spread = info->spread;
+			add_stroke(info->stroke);
+			for(const Stroke& y : info->samples) add_stroke(y);
+			info_ids.emplace(info, infos.size());
+			infos.push_back(x);
+		}
+		uint32_t get_info(const StrokeInfo* info) const { return info_ids.at(info); }
+		
+		uint32_t add_action(const Action* action) {
+			if(!action) return compiled_none;
+			auto it = action_ids.find(action);
+			if(it != action_ids.end()) return it->second;
+			current = CompiledAction{};
+			const Misc* misc = dynamic_cast<const Misc*>(action);
+			if(misc) misc->convert()->visit(this);
+			else action->visit(this);
+			uint32_t id = actions.size();
+			actions.push_back(current);
+			action_ids.emplace(action, id);
+			return id;
+		}
+		
+		void visit(const Command* action) override {
+			/* note: the desktop file is only used by the GUI */
+			current.type = CompiledAction::COMMAND;
+			current.str = add_string(action->get_cmd());
+		}
+		void visit(const SendKey* action) override {
+			current.type = CompiledAction::SEND_KEY;
+			current.mods = action->get_mods();
+			current.arg1 = action->get_key();
+		}
+		void visit(const SendText* action) override {
+			current.type = CompiledAction::SEND_TEXT;
+			current.str = add_string(action->get_text());
+		}
+		void visit(const Scroll* action) override {
+			current.type = CompiledAction::SCROLL;
+			current.mods = action->get_mods();
+		}
+		void visit(const Ignore* action) override {
+			current.type = CompiledAction::IGNORE;
+			current.mods = action->get_mods();
+		}
+		void visit(const Button* action) override {
+			current.type = CompiledAction::BUTTON;
+			current.mods = action->get_mods();
+			current.arg1 = action->get_button();
+		}
+		void visit(const Global* action) override {
+			current.type = CompiledAction::GLOBAL;
+			current.arg1 = static_cast<uint32_t>(action->get_action_type());
+		}
+		void visit(const View* action) override {
+			current.type = CompiledAction::VIEW;
+			current.arg1 = static_cast<uint32_t>(action->get_action_type());
+		}
+		void visit(const Plugin* action) override {
+			current.type = CompiledAction::PLUGIN;
+			current.str = add_string(action->get_action());
+		}
+		void visit(const Touchpad* action) override {
+			current.type = CompiledAction::TOUCHPAD;
+			current.mods = action->get_mods();
+			current.arg1 = static_cast<uint32_t>(action->get_action_type());
+			current.arg2 = action->fingers;
+		}
+		
+	private:
+		std::unordered_map<std::string, uint32_t> string_ids;
+		std::unordered_map<const StrokeInfo*, uint32_t> info_ids;
+		std::unordered_map<const Action*, uint32_t> action_ids;
+		CompiledAction current;
+		
+		void add_stroke(const Stroke& s) {
+			CompiledStroke x;
+			x.n = s.size();
+			x.reserved = 0;
+			x.data = data.size();
+			data.resize(data.size() + stroke_data_size(x.n));
+			stroke_get_data(s.stroke.get(), data.data() + x.data);
+			strokes.push_back(x);
+		}
+};
+
+void ActionDB::write_compiled(const std::string& file_name, const std::string& source_file_name) const {
+	CompiledWriter w;
+	std::vector<MatchEntry> tmp;
+	std::unordered_map<const ActionListDiff<false>*, uint32_t> list_ids;
+	/* note: gestures are added in the same order as in build_index(), so
+	 * that the index is the same as when reading the text archive */
+	std::vector<const ActionListDiff<false>*> lists{&root};
+	while(!lists.empty()) {
+		const ActionListDiff<false>* list = lists.back();
+		lists.pop_back();
+		for(const auto& x : list->added) if(!x.second.stroke.trivial()) w.add_info(&x.second);
+		
+		CompiledList l;
+		l.name = w.add_string(list->name);
+		l.parent = list->parent ? list_ids.at(list->parent) : compiled_none;
+		l.app = list->app;
+		l.first_entry = w.entries.size();
+		list->get_match_entries(tmp);
+		l.n_entries = tmp.size();
+		for(const MatchEntry& e : tmp)
+			w.entries.push_back(CompiledEntry{e.id, w.get_info(e.info), w.add_action(e.action), w.add_string(*e.name)});
+		list_ids.emplace(list, w.lists.size());
+		w.lists.push_back(l);
+		
+		for(const auto& x : list->children) lists.push_back(&x);
+	}
+	for(const std::string& x : exclude_apps) w.exclude.push_back(w.add_string(x));
+	
+	CompiledHeader h = {};
+	static_assert(sizeof(CompiledHeader) % 8 == 0);
+	memcpy(h.magic, compiled_magic, sizeof(h.magic));
+	h.version = compiled_version;
+	h.byte_order = compiled_byte_order;
+	struct stat st;
+	if(stat(source_file_name.c_str(), &st))
+		throw std::runtime_error("ActionDB::write_compiled(): cannot access the source file!\n");
+	h.source_size = st.st_size;
+	h.source_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	
+	uint64_t size = sizeof(CompiledHeader);
+	auto place = [&size] (CompiledSection& sec, size_t count, size_t elem) {
+		sec.offset = size;
+		sec.count = count;
+		size += (count * elem + 7) & ~(uint64_t)7;
+	};
+	place(h.chars, w.chars.size(), sizeof(char));
+	place(h.strings, w.strings.size(), sizeof(uint32_t));
+	place(h.data, w.data.size(), sizeof(double));
+	place(h.strokes, w.strokes.size(), sizeof(CompiledStroke));
+	place(h.infos, w.infos.size(), sizeof(CompiledInfo));
+	place(h.actions, w.actions.size(), sizeof(CompiledAction));
+	place(h.lists, w.lists.size(), sizeof(CompiledList));
+	place(h.entries, w.entries.size(), sizeof(CompiledEntry));
+	place(h.exclude, w.exclude.size(), sizeof(uint32_t));
+	h.size = size;
+	
+	std::vector<uint64_t> buf(size / 8, 0);
+	char* base = reinterpret_cast<char*>(buf.data());
+	auto copy = [base] (const CompiledSection& sec, const void* src, size_t elem) {
+		if(sec.count) memcpy(base + sec.offset, src, sec.count * elem);
+	};
+	copy(h.chars, w.chars.data(), sizeof(char));
+	copy(h.strings, w.strings.data(), sizeof(uint32_t));
+	copy(h.data, w.data.data(), sizeof(double));
+	copy(h.strokes, w.strokes.data(), sizeof(CompiledStroke));
+	copy(h.infos, w.infos.data(), sizeof(CompiledInfo));
+	copy(h.actions, w.actions.data(), sizeof(CompiledAction));
+	copy(h.lists, w.lists.data(), sizeof(CompiledList));
+	copy(h.entries, w.entries.data(), sizeof(CompiledEntry));
+	copy(h.exclude, w.exclude.data(), sizeof(uint32_t));
+	const size_t header_words = sizeof(CompiledHeader) / 8;
+	h.checksum = compiled_checksum(buf.data() + header_words, buf.size() - header_words);
+	memcpy(base, &h, sizeof(CompiledHeader));
+	
+	std::string tmp_name = file_name + ".tmp";
+	std::ofstream ofs(tmp_name.c_str(), std::ios::binary);
+	ofs.write(base, size);
+	ofs.close();
+	if(!ofs) throw std::runtime_error(_("writing the compiled actions failed"));
+	if (rename(tmp_name.c_str(), file_name.c_str()))
+		throw std::runtime_error(_("rename() failed"));
+}
+
 template<>
 void ActionListDiff<false>::remove(unique_t id, bool really, ActionListDiff<false>* skip) {
 	if(!really) deleted.insert(id);
@@ -93,6 +296,8 @@ StrokeRow ActionListDiff<false>::get_info(stroke_id id, bool need_attr) const {
 	}
 	if(!parent || !i->second.stroke.trivial()) {
 		si.stroke = &i->second.stroke;
+		si.samples = &i->second.samples;
+		si.spread = i->second.spread;
 		if(need_attr) si.stroke_overwrite = (parent != nullptr);
 	}
 	if(i->second.action) {
@@ -299,7 +504,7 @@ bool ActionDB::move_stroke_to_app(ActionListDiff<false>* src, ActionListDiff<fal
 					if(stroke_map.at(id).second == tmp) change_owner = true;
 					bool erase = true;
 					if(!it->second.stroke.trivial()) {
-						if(info.stroke.trivial()) info.stroke = std::move(it->second.stroke);
+						if(info.stroke.trivial()) info.move_samples(it->second);
 						else erase = false;
 					}
 					if(it->second.name != "") {
@@ -315,7 +520,7 @@ bool ActionDB::move_stroke_to_app(ActionListDiff<false>* src, ActionListDiff<fal
 				tmp = tmp->parent;
 			} while(tmp != dst);
 			StrokeInfo& di = dst->added[id]; // this might add a new element to dst->added
-			if(!info.stroke.trivial()) di.stroke = std::move(info.stroke);
+			if(!info.stroke.trivial()) di.move_samples(info);
 			if(info.name != "") di.name = std::move(info.name);
 			if(info.action) di.action = std::move(info.action);
 			if(change_owner) stroke_map.at(id).second = dst;
@@ -364,7 +569,7 @@ bool ActionDB::move_stroke_to_app(ActionListDiff<false>* src, ActionListDiff<fal
 					if(it2->second.name != "") copy_name = true;
 					if(it2->second.action) copy_action = true;
 				}
-				if(copy_stroke && info.stroke.trivial()) info.stroke = r.stroke->clone();
+				if(copy_stroke && info.stroke.trivial()) info.copy_samples(*r.stroke, r.samples, r.spread);
 				if(copy_name && info.name == "") info.name = *r.name;
 				if(copy_action && !info.action) info.action = r.action->clone();
 				dst->deleted.erase(id);
@@ -387,7 +592,7 @@ bool ActionDB::move_stroke_to_app(ActionListDiff<false>* src, ActionListDiff<fal
 		 * anything needs to be copied. */
 		if(rsrc.stroke != rdst.stroke) {
 			if(!info) info = &(dst->added[id]);
-			info->stroke = rsrc.stroke->clone();
+			info->copy_samples(*rsrc.stroke, rsrc.samples, rsrc.spread);
 		}
 		if(rsrc.name != rdst.name) {
 			if(!info) info = &(dst->added[id]);
@@ -404,7 +609,7 @@ bool ActionDB::move_stroke_to_app(ActionListDiff<false>* src, ActionListDiff<fal
 		StrokeInfo info;
 		info.name = *r.name;
 		info.action = r.action->clone();
-		info.stroke = r.stroke->clone();
+		info.copy_samples(*r.stroke, r.samples, r.spread);
 		add_stroke(dst, std::move(info));
 	}
 	return false;
@@ -457,7 +662,7 @@ void ActionDB::merge_actions(ActionDB&& other) {
 				auto it2 = id_map.find(id);
 				if(it2 != id_map.end()) {
 					/* note: we use clone, since this might be an inherited stroke */
-					if(r.stroke) action_list->set_stroke(it2->second, r.stroke->clone());
+					if(r.stroke) action_list->added[it2->second].copy_samples(*r.stroke, r.samples, r.spread);
 					if(r.name) action_list->set_name(it2->second, *r.name);
 					if(r.action) action_list->set_action(it2->second, r.action->clone());
 				}
@@ -466,7 +671,7 @@ void ActionDB::merge_actions(ActionDB&& other) {
 					StrokeInfo info;
 					if(r.name) info.name = *r.name;
 					if(r.action) info.action = r.action->clone();
-					if(r.stroke) info.stroke = r.stroke->clone();
+					if(r.stroke) info.copy_samples(*r.stroke, r.samples, r.spread);
 					add_stroke(action_list, std::move(info));
 				}
 			}
@@ -485,5 +690,100 @@ void ActionDB::overwrite_actions(ActionDB&& other) {
 	for(auto& x : stroke_map) if(x.second.second == &other.root) x.second.second = &root;
 }
 
+unsigned int ActionDB::compact_strokes(double min_score) {
+	CompactedStrokes compacted = get_compacted(min_score);
+	unsigned int removed = compacted.removed;
+	set_compacted(std::move(compacted));
+	return removed;
+}
+
+ActionDB::CompactedStrokes ActionDB::get_compacted(double min_score, const progress_func& progress) const {
+	CompactedStrokes ret;
+	std::vector<const StrokeInfo*> infos;
+	std::vector<const ActionListDiff<false>*> lists{&root};
+	while(!lists.empty()) {
+		const ActionListDiff<false>* list = lists.back();
+		lists.pop_back();
+		for(const auto& x : list->added) if(!x.second.stroke.trivial()) infos.push_back(&x.second);
+		for(const auto& x : list->children) lists.push_back(&x);
+	}
+	for(size_t i = 0; i < infos.size(); i++) {
+		if(progress && !progress((double)i / infos.size())) break;
+		const StrokeInfo& info = *infos[i];
+		unsigned int n = 0;
+		std::vector<Stroke> all;
+		all.push_back(info.stroke.simplify(min_score));
+		n += info.stroke.size() - all.back().size();
+		for(const Stroke& y : info.samples) {
+			all.push_back(y.simplify(min_score));
+			n += y.size() - all.back().size();
+		}
+		if(n) {
+			ret.removed += n;
+			ret.strokes.emplace(&info, std::move(all));
+		}
+	}
+	return ret;
+}
 
+void ActionDB::set_compacted(CompactedStrokes&& compacted) {
+	std::vector<ActionListDiff<false>*> lists{&root};
+	while(!lists.empty() && !compacted.strokes.empty()) {
+		ActionListDiff<false>* list = lists.back();
+		lists.pop_back();
+		for(auto& x : list->added) {
+			auto it = compacted.strokes.find(&x.second);
+			if(it == compacted.strokes.end()) continue;
+			/* keep the main stroke (only its spread to the others is
+			 * computed again), unless simplifying it made it trivial */
+			bool keep_first = !it->second[0].trivial();
+			x.second.set_samples(std::move(it->second), keep_first);
+			compacted.strokes.erase(it);
+		}
+		for(auto& x : list->children) lists.push_back(&x);
+	}
+}
 
+std::vector<ActionDB::DuplicateStrokes> ActionDB::find_duplicates(double min_score, const progress_func& progress) const {
+	std::vector<DuplicateStrokes> ret;
+	/* pairs scoring less than min_score have a larger cost than this, so
+	 * they can be skipped by their lower bound or rejected early */
+	double max_cost = (1.0 - min_score) / 2.5 + 1e-9;
+	/* strokes used in each list, collected first to know the number of pairs */
+	std::vector<std::pair<const ActionListDiff<false>*, std::vector<std::pair<stroke_id, const Stroke*>>>> all;
+	double n_pairs = 0.0;
+	std::vector<const ActionListDiff<false>*> lists{&root};
+	while(!lists.empty()) {
+		const ActionListDiff<false>* list = lists.back();
+		lists.pop_back();
+		std::vector<std::pair<stroke_id, const Stroke*>> strokes;
+		for(stroke_id id : list->get_ids(false)) {
+			StrokeRow si = list->get_info(id, false);
+			if(si.stroke && !si.stroke->trivial()) strokes.emplace_back(id, si.stroke);
+		}
+		n_pairs += 0.5 * strokes.size() * (strokes.size() - 1.0);
+		all.emplace_back(list, std::move(strokes));
+		for(const auto& x : list->children) lists.push_back(&x);
+	}
+	double done = 0.0;
+	for(const auto& x : all) {
+		const ActionListDiff<false>* list = x.first;
+		const auto& strokes = x.second;
+		for(size_t i = 0; i < strokes.size(); i++) {
+			if(progress && !progress(done / n_pairs)) return ret;
+			done += strokes.size() - i - 1;
+			for(size_t j = i + 1; j < strokes.size(); j++) {
+				if(!list->has_stroke(strokes[i].first) && !list->has_stroke(strokes[j].first)) continue;
+				const Stroke& a = *strokes[i].second;
+				const Stroke& b = *strokes[j].second;
+				/* the bound is the same for both orders, so it is only computed once */
+				if(Stroke::lower_bound(a, b) > max_cost) continue;
+				double score1, score2;
+				if(Stroke::compare(a, b, score1, max_cost) < 0 || score1 < min_score) continue;
+				if(Stroke::compare(b, a, score2, max_cost) < 0 || score2 < min_score) continue;
+				ret.push_back(DuplicateStrokes{list, strokes[i].first, strokes[j].first, std::min(score1, score2)});
+			}
+		}
+	}
+	return ret;
+}
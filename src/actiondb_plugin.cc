@@ -17,53 +17,776 @@
 
 #include "gesture.h"
 #include "actiondb.h"
-
-template<>
-const std::string& ActionListDiff<false>::get_stroke_name(unique_t id) const {
-	auto it = added.find(id);
-	if(it != added.end() && it->second.name != "") return it->second.name;
-	//!! TODO: check for non-null parent ??
-	return parent->get_stroke_name(id);
-}
+#include "thread_pool.h"
+#include "actiondb_compiled.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 template<>
 std::map<stroke_id, const Stroke*> ActionListDiff<false>::get_strokes() const {
-	std::map<stroke_id, const Stroke*> strokes = parent ? parent->get_strokes() : std::map<stroke_id, const Stroke*>();
-	for(const auto& x : deleted) strokes.erase(x);
-	for(const auto& x : added) if(!x.second.stroke.trivial()) strokes[x.first] = &x.second.stroke;
+	std::map<stroke_id, const Stroke*> strokes;
+	for(const auto& x : get_stroke_infos()) strokes.emplace_hint(strokes.end(), x.first, &x.second->stroke);
 	return strokes;
 }
 
 template<>
-Action* ActionListDiff<false>::handle(const Stroke& s, Ranking* r) const {
+const std::vector<MatchEntry>& ActionListDiff<false>::get_match_table(std::vector<MatchEntry>& tmp) const {
+	if(has_match_table) return match_table;
+	get_match_entries(tmp);
+	return tmp;
+}
+
+void ActionDB::build_match_tables() {
+	if(compiled_map) return; /* tables were read along with the strokes */
+	std::vector<ActionListDiff<false>*> lists{&root};
+	while(!lists.empty()) {
+		ActionListDiff<false>* list = lists.back();
+		lists.pop_back();
+		list->get_match_entries(list->match_table);
+		list->has_match_table = true;
+		for(auto& x : list->children) lists.push_back(&x);
+	}
+}
+
+/* Check that the whole file is there and matches the one it was created
+ * from, and that all sections and references in it are valid; this way,
+ * read_compiled() can use it without any further checks. */
+static bool compiled_valid(const char* base, size_t size, const struct stat& source) {
+	const CompiledHeader& h = *reinterpret_cast<const CompiledHeader*>(base);
+	if(memcmp(h.magic, compiled_magic, sizeof(h.magic)) || h.version != compiled_version ||
+		h.byte_order != compiled_byte_order || h.size != size || size % 8) return false;
+	if(h.source_size != source.st_size ||
+		h.source_mtime != (int64_t)source.st_mtim.tv_sec * 1000000000LL + source.st_mtim.tv_nsec) return false;
+	
+	auto section_valid = [size] (const CompiledSection& sec, size_t elem) {
+		return sec.offset % 8 == 0 && sec.offset >= sizeof(CompiledHeader) && sec.offset <= size &&
+			sec.count <= (size - sec.offset) / elem;
+	};
+	if(!(section_valid(h.chars, sizeof(char)) && section_valid(h.strings, sizeof(uint32_t)) &&
+		section_valid(h.data, sizeof(double)) && section_valid(h.strokes, sizeof(CompiledStroke)) &&
+		section_valid(h.infos, sizeof(CompiledInfo)) && section_valid(h.actions, sizeof(CompiledAction)) &&
+		section_valid(h.lists, sizeof(CompiledList)) && section_valid(h.entries, sizeof(CompiledEntry)) &&
+		section_valid(h.exclude, sizeof(uint32_t)))) return false;
+	
+	const size_t header_words = sizeof(CompiledHeader) / 8;
+	if(compiled_checksum(reinterpret_cast<const uint64_t*>(base) + header_words, size / 8 - header_words) != h.checksum)
+		return false;
+	
+	/* strings are terminated by the last character */
+	if(h.strings.count && (!h.chars.count || base[h.chars.offset + h.chars.count - 1])) return false;
+	const uint32_t* strings = reinterpret_cast<const uint32_t*>(base + h.strings.offset);
+	for(size_t i = 0; i < h.strings.count; i++) if(strings[i] >= h.chars.count) return false;
+	
+	const CompiledStroke* strokes = reinterpret_cast<const CompiledStroke*>(base + h.strokes.offset);
+	for(size_t i = 0; i < h.strokes.count; i++) {
+		const CompiledStroke& x = strokes[i];
+		if(!x.n || x.n > h.data.count || x.data > h.data.count ||
+			stroke_data_size(x.n) > h.data.count - x.data) return false;
+	}
+	const CompiledInfo* infos = reinterpret_cast<const CompiledInfo*>(base + h.infos.offset);
+	for(size_t i = 0; i < h.infos.count; i++)
+		if(infos[i].stroke >= h.strokes.count || infos[i].n_samples >= h.strokes.count - infos[i].stroke) return false;
+	
+	const CompiledAction* actions = reinterpret_cast<const CompiledAction*>(base + h.actions.offset);
+	for(size_t i = 0; i < h.actions.count; i++) {
+		const CompiledAction& x = actions[i];
+		switch(x.type) {
+			case CompiledAction::COMMAND:
+			case CompiledAction::SEND_TEXT:
+			case CompiledAction::PLUGIN:
+				if(x.str >= h.strings.count) return false;
+				break;
+			case CompiledAction::GLOBAL:
+				if(x.arg1 >= Global::n_actions) return false;
+				break;
+			case CompiledAction::VIEW:
+				if(x.arg1 >= View::n_actions) return false;
+				break;
+			case CompiledAction::TOUCHPAD:
+				if(x.arg1 >= Touchpad::n_actions) return false;
+				break;
+			case CompiledAction::SEND_KEY:
+			case CompiledAction::SCROLL:
+			case CompiledAction::IGNORE:
+			case CompiledAction::BUTTON:
+				break;
+			default:
+				return false;
+		}
+	}
+	
+	const CompiledList* lists = reinterpret_cast<const CompiledList*>(base + h.lists.offset);
+	if(!h.lists.count || lists[0].parent != compiled_none) return false;
+	for(size_t i = 0; i < h.lists.count; i++) {
+		const CompiledList& l = lists[i];
+		if((i && l.parent >= i) || l.name >= h.strings.count || l.first_entry > h.entries.count ||
+			l.n_entries > h.entries.count - l.first_entry) return false;
+	}
+	const CompiledEntry* entries = reinterpret_cast<const CompiledEntry*>(base + h.entries.offset);
+	for(size_t i = 0; i < h.entries.count; i++) {
+		const CompiledEntry& e = entries[i];
+		if(e.info >= h.infos.count || e.name >= h.strings.count ||
+			(e.action != compiled_none && e.action >= h.actions.count)) return false;
+	}
+	for(size_t i = 0; i < h.lists.count; i++)
+		for(size_t j = 1; j < lists[i].n_entries; j++)
+			if(entries[lists[i].first_entry + j - 1].id >= entries[lists[i].first_entry + j].id) return false;
+	
+	const uint32_t* exclude = reinterpret_cast<const uint32_t*>(base + h.exclude.offset);
+	for(size_t i = 0; i < h.exclude.count; i++) if(exclude[i] >= h.strings.count) return false;
+	return true;
+}
+
+static std::unique_ptr<Action> compiled_action(const CompiledAction& x, const std::vector<std::string>& strings) {
+	switch(x.type) {
+		case CompiledAction::COMMAND:
+			return Command::create(strings[x.str]);
+		case CompiledAction::SEND_KEY:
+			return SendKey::create(x.arg1, x.mods);
+		case CompiledAction::SEND_TEXT:
+			return SendText::create(strings[x.str]);
+		case CompiledAction::SCROLL:
+			return Scroll::create(x.mods);
+		case CompiledAction::IGNORE:
+			return Ignore::create(x.mods);
+		case CompiledAction::BUTTON:
+			return Button::create(x.mods, x.arg1);
+		case CompiledAction::GLOBAL:
+			return Global::create(static_cast<Global::Type>(x.arg1));
+		case CompiledAction::VIEW:
+			return View::create(static_cast<View::Type>(x.arg1));
+		case CompiledAction::PLUGIN:
+			return Plugin::create(strings[x.str]);
+		case CompiledAction::TOUCHPAD:
+		default:
+			return Touchpad::create(static_cast<Touchpad::Type>(x.arg1), x.arg2, x.mods);
+	}
+}
+
+bool ActionDB::read_compiled(const std::string& file_name, const std::string& source_file_name) {
+	clear();
+	next_id = 0;
+	struct stat source, st;
+	if(stat(source_file_name.c_str(), &source)) return false;
+	int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return false;
+	void* map = MAP_FAILED;
+	if(!fstat(fd, &st) && st.st_size >= (off_t)sizeof(CompiledHeader))
+		map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return false;
+	/* note: write_compiled() replaces the file instead of changing it, so
+	 * the mapping stays valid (and can be shared with other processes) */
+	size_t size = st.st_size;
+	std::shared_ptr<const void> tmp(map, [size] (const void* p) { munmap(const_cast<void*>(p), size); });
+	const char* base = static_cast<const char*>(map);
+	if(!compiled_valid(base, size, source)) return false;
+	compiled_map = std::move(tmp);
+	
+	const CompiledHeader& h = *reinterpret_cast<const CompiledHeader*>(base);
+	const char* chars = base + h.chars.offset;
+	const uint32_t* strings = reinterpret_cast<const uint32_t*>(base + h.strings.offset);
+	const double* data = reinterpret_cast<const double*>(base + h.data.offset);
+	const CompiledStroke* strokes = reinterpret_cast<const CompiledStroke*>(base + h.strokes.offset);
+	const CompiledInfo* infos = reinterpret_cast<const CompiledInfo*>(base + h.infos.offset);
+	const CompiledAction* actions = reinterpret_cast<const CompiledAction*>(base + h.actions.offset);
+	const CompiledList* lists = reinterpret_cast<const CompiledList*>(base + h.lists.offset);
+	const CompiledEntry* entries = reinterpret_cast<const CompiledEntry*>(base + h.entries.offset);
+	const uint32_t* exclude = reinterpret_cast<const uint32_t*>(base + h.exclude.offset);
+	
+	/* note: these are not resized later, so pointers to them stay valid */
+	compiled_strings.reserve(h.strings.count);
+	for(size_t i = 0; i < h.strings.count; i++) compiled_strings.emplace_back(chars + strings[i]);
+	
+	auto get_stroke = [data, strokes] (uint32_t i) {
+		return Stroke(stroke_from_data(strokes[i].n, data + strokes[i].data));
+	};
+	compiled_infos.resize(h.infos.count);
+	for(size_t i = 0; i < h.infos.count; i++) {
+		StrokeInfo& si = compiled_infos[i];
+		si.stroke = get_stroke(infos[i].stroke);
+		for(uint32_t j = 1; j <= infos[i].n_samples; j++) si.samples.push_back(get_stroke(infos[i].stroke + j));
+		si.spread = infos[i].spread;
+	}
+	
+	compiled_actions.reserve(h.actions.count);
+	for(size_t i = 0; i < h.actions.count; i++) compiled_actions.push_back(compiled_action(actions[i], compiled_strings));
+	
+	std::vector<ActionListDiff<false>*> all_lists;
+	for(size_t i = 0; i < h.lists.count; i++) {
+		const CompiledList& l = lists[i];
+		ActionListDiff<false>* list = &root;
+		if(i) list = all_lists[l.parent]->add_child(compiled_strings[l.name], l.app);
+		else root.app = l.app;
+		all_lists.push_back(list);
+		list->match_table.reserve(l.n_entries);
+		for(uint32_t j = 0; j < l.n_entries; j++) {
+			const CompiledEntry& e = entries[l.first_entry + j];
+			MatchEntry x;
+			x.id = e.id;
+			x.info = &compiled_infos[e.info];
+			x.action = (e.action == compiled_none) ? nullptr : compiled_actions[e.action].get();
+			x.name = &compiled_strings[e.name];
+			list->match_table.push_back(x);
+		}
+		list->has_match_table = true;
+	}
+	root.add_apps(apps);
+	
+	for(size_t i = 0; i < h.exclude.count; i++) exclude_apps.insert(compiled_strings[exclude[i]]);
+	return true;
+}
+
+/* Compare s to template y if it can score higher than max_cost allows,
+ * skipping it if its signature shows that it cannot. Returns the same
+ * as Stroke::compare(), or -1 if y was skipped. */
+static int compare_template(const Stroke& s, const Stroke& y, double &score, double max_cost,
+		const MatchOptions& opts, unsigned int& n_compared, unsigned int& n_pruned) {
+	score = 0.0;
+	if(opts.prefilter == MatchOptions::Prefilter::Heuristic &&
+			Stroke::signature_distance(s, y) > opts.prefilter_tolerance) {
+		n_pruned++;
+		return -1;
+	}
+	if(opts.prefilter != MatchOptions::Prefilter::None && opts.engine == Stroke::Engine::Exact &&
+			Stroke::lower_bound(s, y) > max_cost) {
+		n_pruned++;
+		return -1;
+	}
+	n_compared++;
+	return Stroke::compare(s, y, score, max_cost, opts.engine);
+}
+
+/* Compare s to the additional samples of info if any of them is estimated
+ * to score at least min_score, given that the medoid scored at most bound
+ * (see StrokeInfo::spread; this estimate is not a strict bound). If a sample scores higher than score, score
+ * and stroke are updated to it and true is returned. */
+static bool compare_samples(const Stroke& s, const StrokeInfo& info, double min_score, double bound, double& score,
+		const Stroke*& stroke, const MatchOptions& opts, unsigned int& n_compared, unsigned int& n_pruned) {
+	bool ret = false;
+	if(bound + info.spread < min_score) return ret;
+	for(const Stroke& x : info.samples) {
+		double tmp;
+		/* small margin, so that samples with the same score as min_score are not rejected */
+		double max_cost = (1.0 - std::max(min_score, score)) / 2.5 + 1e-9;
+		if(compare_template(s, x, tmp, max_cost, opts, n_compared, n_pruned) < 0) continue;
+		if(tmp > score) {
+			score = tmp;
+			stroke = &x;
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+static double usage_time_now() {
+	return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+double UsageStats::decayed(const Count& c, double now) const {
+	if(half_life <= 0.0 || now <= c.time) return c.count;
+	return c.count * std::exp2((c.time - now) / half_life);
+}
+
+void UsageStats::record(stroke_id id) {
+	double now = usage_time_now();
+	Count& c = counts[id];
+	c.count = decayed(c, now) + 1.0;
+	c.time = now;
+}
+
+double UsageStats::get(stroke_id id) const {
+	auto it = counts.find(id);
+	return (it == counts.end()) ? 0.0 : decayed(it->second, usage_time_now());
+}
+
+bool UsageStats::read(const std::string& file_name) {
+	std::ifstream f(file_name);
+	if(!f) return false;
+	counts.clear();
+	std::string line;
+	while(std::getline(f, line)) {
+		if(line.empty() || line[0] == '#') continue;
+		stroke_id id;
+		Count c;
+		std::istringstream ss(line);
+		if(ss >> id >> c.count >> c.time) counts[id] = c;
+	}
+	return true;
+}
+
+bool UsageStats::write(const std::string& file_name) const {
+	std::string tmp_name = file_name + ".tmp";
+	{
+		std::ofstream f(tmp_name, std::ios::trunc);
+		if(!f) return false;
+		f << "# wstroke gesture usage: id count time\n";
+		f.precision(17);
+		for(const auto& x : counts) f << x.first << ' ' << x.second.count << ' ' << x.second.time << '\n';
+		f.close();
+		if(!f) {
+			unlink(tmp_name.c_str());
+			return false;
+		}
+	}
+	if(rename(tmp_name.c_str(), file_name.c_str())) {
+		unlink(tmp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+void UsageStats::order(const std::vector<MatchEntry>& entries, std::vector<unsigned int>& out, std::vector<double>& tmp) const {
+	double now = usage_time_now();
+	tmp.assign(entries.size(), 0.0);
+	for(size_t i = 0; i < entries.size(); i++) {
+		auto it = counts.find(entries[i].id);
+		if(it != counts.end()) tmp[i] = decayed(it->second, now);
+	}
+	out.resize(entries.size());
+	for(unsigned int i = 0; i < out.size(); i++) out[i] = i;
+	/* note: std::stable_sort() could allocate, use the indices for ties instead */
+	std::sort(out.begin(), out.end(), [&tmp](unsigned int i, unsigned int j) {
+		return tmp[i] > tmp[j] || (tmp[i] == tmp[j] && i < j);
+	});
+}
+
+void UsageStats::sort(std::vector<const MatchEntry*>& entries, std::vector<std::pair<double, const MatchEntry*>>& tmp) const {
+	double now = usage_time_now();
+	tmp.clear();
+	for(const MatchEntry* e : entries) {
+		auto it = counts.find(e->id);
+		tmp.emplace_back((it == counts.end()) ? 0.0 : decayed(it->second, now), e);
+	}
+	/* note: std::stable_sort() could allocate, use the IDs for ties instead */
+	std::sort(tmp.begin(), tmp.end(), [](const auto& x, const auto& y) {
+		return x.first > y.first || (x.first == y.first && x.second->id < y.second->id);
+	});
+	for(size_t i = 0; i < tmp.size(); i++) entries[i] = tmp[i].second;
+}
+
+std::vector<double> StrokeIndex::pivot_costs(const Stroke& s) const {
+	std::vector<double> ret;
+	pivot_costs(s, ret);
+	return ret;
+}
+
+void StrokeIndex::pivot_costs(const Stroke& s, std::vector<double>& out) const {
+	out.clear();
+	for(const Stroke* p : pivots)
+		out.push_back(s.stroke ? stroke_compare(s.stroke.get(), p->stroke.get(), nullptr, nullptr) : stroke_infinity);
+}
+
+double StrokeIndex::estimate(const std::vector<double>& q, const Stroke* t) const {
+	auto it = costs.find(t);
+	if(it == costs.end() || q.size() != it->second.size()) return 0.0;
+	double ret = 0.0;
+	for(size_t i = 0; i < q.size(); i++) {
+		/* costs are capped at stroke_infinity, so this is zero if both are capped */
+		double d = std::abs(q[i] - it->second[i]);
+		if(d > ret) ret = d;
+	}
+	return ret;
+}
+
+void ActionDB::build_index(unsigned int n_pivots) {
+	index = StrokeIndex();
+	std::vector<const Stroke*> strokes;
+	std::vector<const ActionListDiff<false>*> lists{&root};
+	while(!lists.empty()) {
+		const ActionListDiff<false>* list = lists.back();
+		lists.pop_back();
+		for(const auto& x : list->added) if(!x.second.stroke.trivial()) strokes.push_back(&x.second.stroke);
+		for(const auto& x : list->children) lists.push_back(&x);
+	}
+	/* note: these are in the same order as above (see write_compiled()) */
+	for(const auto& x : compiled_infos) if(!x.stroke.trivial()) strokes.push_back(&x.stroke);
+	if(strokes.size() <= n_pivots) return; /* no use for an index */
+	
+	/* choose pivots greedily, each one being the farthest from the ones before */
+	std::vector<double> min_cost(strokes.size(), stroke_infinity);
+	size_t next = 0;
+	for(unsigned int k = 0; k < n_pivots; k++) {
+		const Stroke* p = strokes[next];
+		index.pivots.push_back(p);
+		size_t far = 0;
+		for(size_t i = 0; i < strokes.size(); i++) {
+			double c = stroke_compare(strokes[i]->stroke.get(), p->stroke.get(), nullptr, nullptr);
+			index.costs[strokes[i]].push_back(c);
+			if(c < min_cost[i]) min_cost[i] = c;
+			if(min_cost[i] > min_cost[far]) far = i;
+		}
+		next = far;
+	}
+}
+
+/* Check if a scan can stop after finding best_score, with second_score
+ * being the best among the other templates (see MatchOptions::stop_early). */
+static bool good_enough(double best_score, double second_score, const MatchOptions& opts) {
+	return opts.stop_early && best_score >= opts.stop_score && best_score - second_score >= opts.stop_margin;
+}
+
+/* Compare s to the templates in [begin, end), rejecting the ones that
+ * cannot score higher than the best one before them in this range (or
+ * the same, if keep_ties is true). Returns the index of the best template
+ * in the range, or -1. If the scan is stopped early, stop is set to the
+ * first template that was not considered (otherwise, to end). */
+static int scan_templates(const Stroke& s, const std::vector<const MatchEntry*>& templates,
+		size_t begin, size_t end, std::vector<stroke_score_t>& scores, const MatchOptions& opts, bool keep_ties,
+		size_t& stop) {
+	stop = end;
+	if(opts.engine == Stroke::Engine::Exact && !opts.stop_early) {
+		/* note: this can run on several threads in parallel, each needs its own copy */
+		static thread_local std::vector<const stroke_t*> tmp;
+		static thread_local std::vector<stroke_score_t> res;
+		tmp.resize(end - begin);
+		for(size_t i = begin; i < end; i++) tmp[i - begin] = templates[i]->info->stroke.stroke.get();
+		int flags = STROKE_COMPARE_EARLY_REJECT;
+		if(opts.prefilter != MatchOptions::Prefilter::None) flags |= STROKE_COMPARE_PREFILTER;
+		if(keep_ties) flags |= STROKE_COMPARE_KEEP_TIES;
+		int best = Stroke::compare_many(s, tmp, res, flags);
+		std::copy(res.begin(), res.end(), scores.begin() + begin);
+		return (best >= 0) ? (int)(best + begin) : -1;
+	}
+	
 	double best_score = 0.0;
-	Action* ret = nullptr;
-	if(r) r->stroke = &s;
-	const auto strokes = get_strokes();
-	for(const auto& x : strokes) {
-		const Stroke& y = *x.second;
+	double second_score = 0.0;
+	int best = -1;
+	for(size_t i = begin; i < end; i++) {
+		if(good_enough(best_score, second_score, opts)) {
+			for(stop = i; i < end; i++) scores[i] = stroke_score_t{stroke_infinity, 0.0, 0, (int)i};
+			break;
+		}
+		unsigned int n_compared = 0, n_pruned = 0;
 		double score;
-		int match = Stroke::compare(s, y, score);
-		if (match < 0)
-			continue;
-		bool new_best = false;
+		double max_cost = (1.0 - best_score) / 2.5 + (keep_ties ? 1e-9 : 0.0);
+		int match = compare_template(s, templates[i]->info->stroke, score, max_cost, opts, n_compared, n_pruned);
+		scores[i] = stroke_score_t{stroke_infinity, 0.0, (int)n_compared, (int)i};
+		if(match < 0) continue;
+		scores[i].score = score;
+		scores[i].cost = (1.0 - score) / 2.5; /* only used to check for a match */
 		if(score > best_score) {
-			new_best = true;
+			second_score = best_score;
 			best_score = score;
-			ret = get_stroke_action(x.first);
-			if(r) r->best_stroke = &y;
+			best = i;
+		}
+		else if(score > second_score) second_score = score;
+	}
+	return best;
+}
+
+/* Temporary storage used by handle(). This is kept between calls (on
+ * each thread separately), so that matching does not allocate memory
+ * once these have grown large enough. */
+struct MatchScratch {
+	std::vector<MatchEntry> entries; /* only used if there is no match table */
+	std::vector<const MatchEntry*> templates;
+	std::vector<double> pivot_costs;
+	std::vector<double> coarse, coarse_sorted;
+	std::vector<std::pair<double, const MatchEntry*>> usage;
+	std::vector<stroke_score_t> scores;
+	std::vector<size_t> shard_stop;
+	std::vector<const Stroke*> matched;
+	std::vector<bool> skipped;
+};
+
+template<>
+Action* ActionListDiff<false>::handle(const Stroke& s, Ranking* r, const MatchOptions& opts) const {
+	static thread_local MatchScratch tmp;
+	unsigned int n_compared = 0, n_pruned = 0;
+	if(r) r->stroke = &s;
+	auto& templates = tmp.templates;
+	templates.clear();
+	auto& pivot_costs = tmp.pivot_costs;
+	pivot_costs.clear();
+	if(opts.index && !opts.index->empty()) opts.index->pivot_costs(s, pivot_costs);
+	for(const MatchEntry& x : get_match_table(tmp.entries)) {
+		const Stroke* y = &x.info->stroke;
+		if(opts.prefilter == MatchOptions::Prefilter::Heuristic &&
+				Stroke::signature_distance(s, *y) > opts.prefilter_tolerance) {
+			n_pruned++;
+			continue;
+		}
+		if(!pivot_costs.empty() && opts.index->estimate(pivot_costs, y) > opts.index_tolerance) {
+			n_pruned++;
+			continue;
+		}
+		templates.push_back(&x);
+	}
+	
+	if(opts.coarse_top_k > 0 && templates.size() > opts.coarse_top_k) {
+		/* keep the candidates that are best based on the coarse comparison,
+		 * in their original order (this way, ties are handled as before) */
+		auto& coarse = tmp.coarse;
+		coarse.resize(templates.size());
+		for(size_t i = 0; i < templates.size(); i++) coarse[i] = Stroke::compare_coarse(s, templates[i]->info->stroke);
+		auto& sorted = tmp.coarse_sorted;
+		sorted.assign(coarse.begin(), coarse.end());
+		std::nth_element(sorted.begin(), sorted.begin() + (opts.coarse_top_k - 1), sorted.end(), std::greater<double>());
+		double limit = std::min(sorted[opts.coarse_top_k - 1], *std::max_element(coarse.begin(), coarse.end()) - opts.coarse_margin);
+		size_t j = 0;
+		for(size_t i = 0; i < templates.size(); i++) {
+			if(coarse[i] < limit) {
+				n_pruned++;
+				continue;
+			}
+			templates[j++] = templates[i];
+		}
+		templates.resize(j);
+	}
+	
+	/* Compare the most used templates first. Templates with the same
+	 * score as the best one before them are not rejected in this case,
+	 * so that ties can be resolved by ID below. */
+	bool keep_ties = false;
+	if(opts.usage && !opts.usage->empty() && templates.size() > 1) {
+		opts.usage->sort(templates, tmp.usage);
+		keep_ties = true;
+	}
+	
+	/* Templates are split into contiguous shards that are processed in
+	 * parallel if a thread pool is given. Within each shard, templates
+	 * are compared in order, rejecting the ones that cannot score
+	 * higher than the best before them in the same shard. Taking the
+	 * template with the highest score (and the smallest ID among those)
+	 * gives the same result as scanning all templates in one go. */
+	size_t n = templates.size();
+	auto& scores = tmp.scores;
+	scores.resize(n);
+	unsigned int n_shards = 1;
+	if(opts.pool && opts.pool->size() > 1 && n >= 2 * opts.pool->size())
+		n_shards = opts.pool->size();
+	auto& shard_stop = tmp.shard_stop;
+	shard_stop.resize(n_shards);
+	auto scan_shard = [&](unsigned int i) {
+		scan_templates(s, templates, n * i / n_shards, n * (i + 1) / n_shards, scores, opts, keep_ties, shard_stop[i]);
+	};
+	if(n_shards > 1) opts.pool->run(n_shards, scan_shard);
+	else scan_shard(0);
+	
+	int best = -1;
+	for(size_t i = 0; i < n; i++) if(scores[i].cost < stroke_infinity && scores[i].score > 0.0) {
+		if(best < 0 || scores[i].score > scores[best].score ||
+			(scores[i].score == scores[best].score && templates[i]->id < templates[best]->id)) best = i;
+	}
+	double best_score = (best >= 0) ? scores[best].score : 0.0;
+	
+	/* Gestures with several samples were only compared by their medoid
+	 * so far. Their other samples are compared only if the medoid is
+	 * within the spread of the samples to the best score. This is
+	 * approximate (the cost is not a metric, so a sample can score
+	 * higher than the medoid plus the spread), but it does not change
+	 * the result for other templates: the ones rejected early above are
+	 * still not better than the one before them. */
+	auto& matched = tmp.matched;
+	matched.resize(n);
+	for(size_t i = 0; i < n; i++) matched[i] = &templates[i]->info->stroke;
+	/* templates not considered if scanning stopped early */
+	auto& skipped = tmp.skipped;
+	skipped.assign(n, false);
+	unsigned int n_skipped = 0;
+	for(unsigned int k = 0; k < n_shards; k++)
+		for(size_t i = shard_stop[k]; i < n * (k + 1) / n_shards; i++) {
+			skipped[i] = true;
+			n_skipped++;
+		}
+	for(size_t i = 0; i < n; i++) {
+		const StrokeInfo& info = *templates[i]->info;
+		if(info.samples.empty() || skipped[i]) continue;
+		double score = scores[i].score;
+		double bound = score; /* upper bound for the score of the medoid */
+		bool match = scores[i].cost < stroke_infinity;
+		if(!match) {
+			/* the medoid was skipped or rejected, it needs to be compared again */
+			unsigned int n1 = 0, n2 = 0;
+			double max_cost = (1.0 - (best_score - info.spread)) / 2.5;
+			if(compare_template(s, info.stroke, score, max_cost, opts, n1, n2) >= 0) match = true;
+			else if(max_cost >= stroke_infinity) bound = 1.0 - 2.5 * stroke_infinity; /* no match at all */
+			else continue;
+			if(match) bound = score;
+			scores[i].compared = 1;
 		}
-		if(r) {
-			const std::string& name = get_stroke_name(x.first);
-			r->r.insert(std::pair<double, std::pair<std::string, const Stroke*> >
-				(score, std::pair<std::string, const Stroke*>(name, &y)));
-			if(new_best) r->name = name;
+		if(compare_samples(s, info, best_score, bound, score, matched[i], opts, n_compared, n_pruned)) match = true;
+		if(!match) continue;
+		scores[i].score = score;
+		scores[i].cost = (1.0 - score) / 2.5;
+		if(score > best_score || (best >= 0 && score == best_score && templates[i]->id < templates[best]->id)) {
+			best_score = score;
+			best = i;
 		}
 	}
+	Action* ret = (best >= 0) ? templates[best]->action : nullptr;
+	
+	n_compared += pivot_costs.size();
+	if(r) r->clear_matches();
+	for(size_t i = 0; i < n; i++) {
+		if(scores[i].compared) n_compared++;
+		else if(!skipped[i]) n_pruned++;
+		/* templates rejected early are not added to r */
+		if(r && r->top_k && scores[i].cost < stroke_infinity)
+			r->add_match(Ranking::Match{scores[i].score, templates[i]->id, matched[i], templates[i]->name});
+	}
+	
+	if(r) {
+		r->best_stroke = (best >= 0) ? matched[best] : nullptr;
+		r->id = (best >= 0) ? templates[best]->id : 0;
+		r->name = (best >= 0) ? templates[best]->name : nullptr;
+		r->score = best_score;
+		r->action = ret;
+		r->n_compared = n_compared;
+		r->n_pruned = n_pruned;
+		r->truncated = (n_skipped > 0);
+		r->n_skipped = n_skipped;
+	}
+	return ret;
+}
+
+/* length of the path along the points of ps */
+static double stroke_length(const Stroke::PreStroke& ps) {
+	double len = 0.0;
+	for(size_t i = 1; i < ps.size(); i++) len += hypot(ps[i].x - ps[i-1].x, ps[i].y - ps[i-1].y);
+	return len;
+}
+
+bool IncrementalMatcher::supports(const MatchOptions& opts) {
+	return !(opts.pool && opts.pool->size() > 1) && !opts.index && !opts.coarse_top_k;
+}
+
+void IncrementalMatcher::start(const ActionListDiff<false>* list_, const MatchOptions& opts_) {
+	reset();
+	list = list_;
+	opts = opts_;
+	if(!list) return;
+	const auto& table = list->get_match_table(templates);
+	if(&table != &templates) templates = table;
+	if(opts.usage) opts.usage->order(templates, order, sort_keys);
+	else {
+		order.resize(templates.size());
+		for(unsigned int i = 0; i < order.size(); i++) order[i] = i;
+	}
+}
+
+void IncrementalMatcher::reset() {
+	list = nullptr;
+	templates.clear();
+	order.clear();
+	n_candidates = 0;
+	/* note: stroke and points are not cleared to reuse their memory */
+	have_stroke = false;
+}
+
+void IncrementalMatcher::start_stroke(const Stroke::PreStroke& ps) {
+	if(have_stroke && done()) {
+		/* compare the most similar templates first next time (keeping
+		 * the previous order for ties; std::stable_sort() could allocate) */
+		sort_keys.resize(order.size());
+		for(size_t k = 0; k < order.size(); k++) sort_keys[order[k]] = k;
+		std::sort(order.begin(), order.end(), [this](unsigned int i, unsigned int j) {
+			return scores[i] > scores[j] || (scores[i] == scores[j] && sort_keys[i] < sort_keys[j]);
+		});
+		n_candidates = 0;
+		while(n_candidates < order.size() && scores[order[n_candidates]] >= 0.0) n_candidates++;
+	}
+	points = ps;
+	stroke.assign(points);
+	length = stroke_length(points);
+	have_stroke = true;
+	next = 0;
+	end = order.size();
+	scores.assign(templates.size(), -1.0);
+	matched.assign(templates.size(), nullptr);
+	best_score = 0.0;
+	second_score = 0.0;
+	best = -1;
+	n_compared = 0;
+	n_pruned = 0;
+}
+
+void IncrementalMatcher::step() {
+	unsigned int i = order[next++];
+	/* Templates are not compared in the order of their IDs, so ties
+	 * are resolved explicitly in favor of the smaller ID (as in
+	 * handle()). A template with the same score as the current best
+	 * is not rejected early due to the small margin added here. */
+	const StrokeInfo& info = *templates[i].info;
+	double max_cost = (1.0 - (best_score - info.spread)) / 2.5 + 1e-9;
+	double score;
+	int match = compare_template(stroke, info.stroke, score, max_cost, opts, n_compared, n_pruned);
+	double bound = score; /* upper bound for the score of the medoid */
+	if(match < 0) {
+		if(info.samples.empty() || max_cost < stroke_infinity) return;
+		bound = 1.0 - 2.5 * stroke_infinity; /* no match at all */
+	}
+	matched[i] = &info.stroke;
+	if(compare_samples(stroke, info, best_score, bound, score, matched[i], opts, n_compared, n_pruned)) match = 0;
+	if(match < 0) return;
+	scores[i] = score;
+	if(score > best_score || (best >= 0 && score == best_score && templates[i].id < templates[best].id)) {
+		second_score = best_score;
+		best_score = score;
+		best = i;
+	}
+	else if(score > second_score) second_score = score;
+}
+
+bool IncrementalMatcher::done() const {
+	return next == end || good_enough(best_score, second_score, opts);
+}
+
+void IncrementalMatcher::update(const Stroke::PreStroke& ps, int budget_us) {
+	if(!list || budget_us <= 0) return;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budget_us);
+	/* A stroke that was already started is matched fully, even if it
+	 * changed in the meantime, since its scores are used for ordering.
+	 * After that, the stroke is only matched again once it has grown
+	 * by min_growth; this is kept small, since finish() only compares
+	 * the best matches of the last version matched to the final stroke,
+	 * so this version should be close to the final one. */
+	if(!have_stroke) start_stroke(ps);
+	else if(done()) {
+		if(stroke_length(ps) < (1.0 + min_growth) * length) return;
+		start_stroke(ps);
+	}
+	while(!done() && std::chrono::steady_clock::now() < deadline) step();
+}
+
+Action* IncrementalMatcher::finish(const Stroke::PreStroke& ps, Ranking* r) {
+	if(!list) return nullptr;
+	if(!have_stroke || points != ps) {
+		start_stroke(ps);
+		/* only the best matches of the last full update are compared again */
+		if(n_candidates) end = std::min(n_candidates, (size_t)finish_candidates);
+	}
+	while(!done()) step();
+	if(best < 0 && end < order.size()) {
+		end = order.size();
+		while(!done()) step();
+	}
 	
+	Action* ret = (best >= 0) ? templates[best].action : nullptr;
 	if(r) {
+		r->stroke = &stroke;
+		r->best_stroke = (best >= 0) ? matched[best] : nullptr;
+		r->id = (best >= 0) ? templates[best].id : 0;
+		r->name = (best >= 0) ? templates[best].name : nullptr;
 		r->score = best_score;
 		r->action = ret;
+		r->n_compared = n_compared;
+		r->n_pruned = n_pruned;
+		r->truncated = (next < order.size());
+		r->n_skipped = order.size() - next;
+		r->clear_matches();
+		if(r->top_k) for(unsigned int i = 0; i < templates.size(); i++) if(scores[i] >= 0.0)
+			r->add_match(Ranking::Match{scores[i], templates[i].id, matched[i], templates[i].name});
 	}
 	return ret;
 }
@@ -30,6 +30,8 @@
 #include "stroke_drawing_area.h"
 #include "config.h"
 #include <typeinfo>
+#include <atomic>
+#include <thread>
 
 class SelectButton {
 public:
@@ -218,11 +220,12 @@ void Actions::startup(Gtk::Application* app, Gtk::Dialog* message_dialog) {
 	widgets->get_widget("button_about", button_about);
 	widgets->get_widget("check_show_deleted", check_show_deleted);
 	
-	Gtk::Button *button_import, *button_export;
+	Gtk::Button *button_import, *button_export, *button_compact;
 	Gtk::LinkButton *import_easystroke, *import_default;
 	widgets->get_widget("import_dialog", import_dialog);
 	widgets->get_widget("button_import", button_import);
 	widgets->get_widget("button_export", button_export);
+	widgets->get_widget("button_compact", button_compact);
 	widgets->get_widget("import_import", button_import_import);
 	widgets->get_widget("import_cancel", button_import_cancel);
 	widgets->get_widget("import_easystroke", import_easystroke);
@@ -237,6 +240,9 @@ void Actions::startup(Gtk::Application* app, Gtk::Dialog* message_dialog) {
 	button_import->signal_clicked().connect([this]() {
 		import_dialog->show_all();
 	});
+	button_compact->signal_clicked().connect([this]() {
+		compact_strokes();
+	});
 	button_import_cancel->signal_clicked().connect([this]() {
 		import_dialog->close();
 	});
@@ -1127,15 +1133,20 @@ class Actions::OnStroke {
 	Actions *parent;
 	Gtk::Dialog *dialog;
 	Gtk::TreeRow &row;
+	Gtk::CheckButton *add_sample;
 public:
 	void run(Stroke* stroke) {
-		parent->action_list->set_stroke(row[parent->cols.id], std::move(*stroke));
+		stroke_id id = row[parent->cols.id];
+		if(add_sample->get_active() && parent->action_list->has_stroke(id))
+			parent->action_list->add_sample(id, std::move(*stroke));
+		else parent->action_list->set_stroke(id, std::move(*stroke));
 		parent->update_row(row);
 		parent->on_selection_changed();
 		parent->update_actions();
 		dialog->response(0);
 	}
-	OnStroke(Actions *parent_, Gtk::Dialog *dialog_, Gtk::TreeRow &row_) : parent(parent_), dialog(dialog_), row(row_) {}
+	OnStroke(Actions *parent_, Gtk::Dialog *dialog_, Gtk::TreeRow &row_, Gtk::CheckButton *add_sample_) :
+		parent(parent_), dialog(dialog_), row(row_), add_sample(add_sample_) {}
 };
 
 void Actions::on_stroke_editing(const char* path) {
@@ -1146,6 +1157,7 @@ void Actions::on_stroke_editing(const char* path) {
 void Actions::on_row_activated(Gtk::TreeRow& row) {
 	Gtk::MessageDialog *dialog;
 	static SRArea *drawarea = nullptr;
+	static Gtk::CheckButton *add_sample = nullptr;
 	widgets->get_widget("dialog_record", dialog);
 	dialog->set_secondary_text(Glib::ustring::compose(_("The next stroke will be associated with the action \"%1\".  You can draw it in the area below. You may need to use a different pointer button than the one normally used for gestures."), row[cols.name]));
 	
@@ -1154,14 +1166,18 @@ void Actions::on_row_activated(Gtk::TreeRow& row) {
 		drawarea->set_size_request(600, 400);
 		auto box = dialog->get_content_area();
 		box->pack_start(*drawarea, true, false, 0);
+		add_sample = Gtk::manage(new Gtk::CheckButton(_("Keep the current stroke and add this as another sample")));
+		box->pack_start(*add_sample, false, false, 0);
 	}
 	
 	static Gtk::Button *del = 0, *cancel = 0;
 	if (!del) widgets->get_widget("button_record_delete", del);
 	if (!cancel) widgets->get_widget("button_record_cancel", cancel);
 	del->set_sensitive(action_list->has_stroke(row[cols.id]));
+	add_sample->set_active(false);
+	add_sample->set_sensitive(action_list->has_stroke(row[cols.id]));
 
-	OnStroke ps(this, dialog, row);
+	OnStroke ps(this, dialog, row, add_sample);
 	sigc::connection sig = drawarea->stroke_recorded.connect(sigc::mem_fun(ps, &OnStroke::run));
 	
 	dialog->show_all();
@@ -1400,10 +1416,95 @@ void Actions::load_command_infos() {
 	load_command_infos_r(*actions.get_root());
 }
 
+/* simplified strokes should score at least this much against the original */
+static const double compact_min_score = 0.99;
+/* strokes scoring at least this much against each other are reported as duplicates */
+static const double duplicate_min_score = 0.9;
+
+bool Actions::run_with_progress(const Glib::ustring& text, const std::function<void(const ActionDB::progress_func&)>& work) {
+	std::atomic<double> fraction{0.0};
+	std::atomic<bool> cancel{false};
+	std::atomic<bool> done{false};
+	Gtk::MessageDialog dialog(*main_win, text, false, Gtk::MESSAGE_OTHER, Gtk::BUTTONS_CANCEL, true);
+	Gtk::ProgressBar bar;
+	dialog.get_message_area()->pack_start(bar, Gtk::PACK_SHRINK);
+	bar.show();
+	
+	/* note: the main window does not accept input while the dialog is
+	 * shown, so actions are not modified until the thread is done */
+	work_running = true;
+	std::thread thread([&] () {
+		work([&] (double x) {
+			fraction = x;
+			return !cancel;
+		});
+		done = true;
+	});
+	auto timer = Glib::signal_timeout().connect([&] () {
+		bar.set_fraction(fraction);
+		if(!done) return true;
+		dialog.response(Gtk::RESPONSE_OK);
+		return false;
+	}, 100);
+	int response = dialog.run();
+	cancel = true;
+	thread.join();
+	timer.disconnect();
+	work_running = false;
+	return response == Gtk::RESPONSE_OK;
+}
+
+void Actions::compact_strokes() {
+	ActionDB::CompactedStrokes compacted;
+	if(!run_with_progress(_("Simplifying the stored strokes..."), [&] (const ActionDB::progress_func& progress) {
+			compacted = actions.get_compacted(compact_min_score, progress);
+		})) return;
+	unsigned int removed = compacted.removed;
+	if(removed) {
+		actions.set_compacted(std::move(compacted));
+		update_action_list();
+		save_actions();
+	}
+	
+	std::vector<ActionDB::DuplicateStrokes> dups;
+	bool searched = run_with_progress(_("Looking for duplicate strokes..."), [&] (const ActionDB::progress_func& progress) {
+			dups = actions.find_duplicates(duplicate_min_score, progress);
+		});
+	
+	Glib::ustring text = Glib::ustring::compose(_("Removed %1 points from the stored strokes."), removed);
+	Glib::ustring secondary;
+	if(!searched) secondary = _("The search for duplicate strokes was cancelled.");
+	else if(dups.empty()) secondary = _("No duplicate strokes were found.");
+	else {
+		secondary = _("The following actions have very similar strokes:");
+		for(const auto& x : dups) {
+			secondary += "\n";
+			secondary += Glib::ustring::compose(_("\"%1\" and \"%2\" in %3 (score: %4)"),
+				*x.list->get_info(x.id1).name, *x.list->get_info(x.id2).name,
+				app_name_hr(x.list->name), std::to_string((int)(100.0 * x.score)) + "%");
+		}
+	}
+	Gtk::MessageDialog dialog(*main_win, text, false, Gtk::MESSAGE_INFO, Gtk::BUTTONS_OK, true);
+	dialog.set_secondary_text(secondary);
+	dialog.run();
+}
+
 void Actions::save_actions() {
 	if(save_error) return;
+	/* newly recorded or imported strokes are simplified here; strokes that
+	 * are already simplified stay the same (checking them is fast), and
+	 * they look the same, so the list is not redrawn */
+	if(!work_running) actions.compact_strokes(compact_min_score);
 	try {
-		actions.write(config_dir + ActionDB::wstroke_actions_versions[0]);
+		std::string config_file = config_dir + ActionDB::wstroke_actions_versions[0];
+		actions.write(config_file);
+		/* the plugin loads this instead if it is up to date; it is not
+		 * a problem if it cannot be saved */
+		try {
+			actions.write_compiled(config_file + ActionDB::compiled_suffix, config_file);
+		} catch (std::exception &e) {
+			fprintf(stderr, _("Warning: Couldn't save compiled actions: %s.\n"), e.what());
+		}
 	} catch (std::exception &e) {
 		save_error = true;
 		fprintf(stderr, _("Error: Couldn't save action database: %s.\n"), e.what());
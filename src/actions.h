@@ -47,6 +47,13 @@ class Actions {
 		void on_cell_data_name(Gtk::CellRenderer* cell, const Gtk::TreeModel::iterator& iter);
 		void on_cell_data_type(Gtk::CellRenderer* cell, const Gtk::TreeModel::iterator& iter);
 		void save_actions();
+		/* simplify stored strokes and report near duplicates */
+		void compact_strokes();
+		/* Run work on a separate thread while showing a modal dialog with
+		 * its progress and a button to cancel it; work should pass its
+		 * argument to the ActionDB function it calls. Returns false if
+		 * it was cancelled. */
+		bool run_with_progress(const Glib::ustring& text, const std::function<void(const ActionDB::progress_func&)>& work);
 		void update_actions() { actions_changed = true; }
 	public:
 		void on_accel_edited(const gchar *path_string, guint accel_key, GdkModifierType accel_mods);
@@ -191,6 +198,7 @@ class Actions {
 		bool actions_changed = false;
 		bool exiting = false;
 		bool save_error = false;
+		bool work_running = false; /* a thread started by run_with_progress() is reading actions */
 };
 
 #endif
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __CONFIG_LOADER_H__
+#define __CONFIG_LOADER_H__
+
+#include "actiondb.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Thread that loads the configuration and saves the usage counts for
+ * the plugin, so that parsing a large file or writing to the disk does
+ * not block the compositor. Loading is done by calling the function
+ * given to the constructor (from the loader thread); when it returns a
+ * new configuration, fd() becomes readable (it can be added to the main
+ * event loop), and the result can be taken with take_loaded(). Requests
+ * made while the thread is busy are merged: only the last one matters.
+ * Errors of loading and saving are not logged on the loader thread, but
+ * passed back in the same way and can be taken with take_errors().
+ * All functions except the load and save functions given here should
+ * be called from the same (main) thread. */
+class ConfigLoader {
+	public:
+		/* returns nullptr if the configuration could not be loaded; both
+		 * can set error to a message that should be logged */
+		using load_func = std::function<ActionDB*(unsigned int n_pivots, std::string& error)>;
+		using save_func = std::function<void(const UsageStats& usage, std::string& error)>;
+
+		ConfigLoader(load_func load_, save_func save_) : load(std::move(load_)), save(std::move(save_)) { }
+		~ConfigLoader() { stop(); }
+		ConfigLoader(const ConfigLoader&) = delete;
+		ConfigLoader& operator = (const ConfigLoader&) = delete;
+
+		/* Start the thread. Returns false if this is not possible (if the
+		 * eventfd cannot be created); loading and saving should then be
+		 * done directly. */
+		bool start() {
+			if(running()) return true;
+			efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if(efd < 0) return false;
+			stop_requested = false;
+			thread = std::thread([this] () { run(); });
+			return true;
+		}
+		bool running() const { return thread.joinable(); }
+		/* readable if a newly loaded configuration or an error is available */
+		int fd() const { return efd; }
+
+		/* load the configuration (again) */
+		void request_load(unsigned int n_pivots) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				load_requested = true;
+				load_pivots = n_pivots;
+			}
+			cv.notify_one();
+		}
+		/* save these counts (replacing any that were not saved yet) */
+		void request_save(std::unique_ptr<UsageStats> usage) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				to_save = std::move(usage);
+			}
+			cv.notify_one();
+		}
+
+		/* the last loaded configuration if it was not taken yet, or nullptr;
+		 * call this when fd() becomes readable (this clears it) */
+		std::unique_ptr<ActionDB> take_loaded() {
+			uint64_t n;
+			while(read(efd, &n, sizeof(n)) > 0) { }
+			return std::unique_ptr<ActionDB>(loaded.exchange(nullptr));
+		}
+		/* error messages of loading or saving since the last call; call
+		 * this together with take_loaded() (and after stop(), for an
+		 * error of a save that was in progress) */
+		std::vector<std::string> take_errors() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return std::move(errors);
+		}
+
+		/* Stop the thread; if it is loading or saving, this waits until
+		 * it is done. A loaded configuration that was not taken is
+		 * discarded. Returns the counts given to request_save() that were
+		 * not saved yet (if any), so that they can be saved directly. */
+		std::unique_ptr<UsageStats> stop() {
+			if(running()) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stop_requested = true;
+				}
+				cv.notify_one();
+				thread.join();
+			}
+			delete loaded.exchange(nullptr);
+			if(efd >= 0) {
+				close(efd);
+				efd = -1;
+			}
+			load_requested = false;
+			return std::move(to_save);
+		}
+
+	private:
+		load_func load;
+		save_func save;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool stop_requested = false; /* protected by mutex */
+		bool load_requested = false; /* protected by mutex */
+		unsigned int load_pivots = 0; /* protected by mutex */
+		std::unique_ptr<UsageStats> to_save; /* protected by mutex */
+		std::vector<std::string> errors; /* protected by mutex */
+		/* set by the loader thread, taken by the main thread */
+		std::atomic<ActionDB*> loaded{nullptr};
+		int efd = -1;
+
+		/* note: this cannot fail, the counter would need to reach 2^64 - 1 */
+		void notify() {
+			uint64_t one = 1;
+			ssize_t ret = write(efd, &one, sizeof(one));
+			(void)ret;
+		}
+
+		/* called with mutex locked */
+		void add_error(std::string&& error) {
+			if(error.empty()) return;
+			errors.push_back(std::move(error));
+			notify();
+		}
+
+		void run() {
+			std::string error;
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true) {
+				cv.wait(lock, [this] () { return stop_requested || load_requested || to_save; });
+				if(stop_requested) return;
+				if(to_save) {
+					std::unique_ptr<UsageStats> tmp = std::move(to_save);
+					lock.unlock();
+					save(*tmp, error);
+					lock.lock();
+					add_error(std::move(error));
+					error.clear();
+					continue;
+				}
+				load_requested = false;
+				unsigned int n_pivots = load_pivots;
+				lock.unlock();
+				ActionDB* tmp = load(n_pivots, error);
+				if(tmp) {
+					/* a previous version that was not taken yet is not needed anymore */
+					delete loaded.exchange(tmp);
+					notify();
+				}
+				lock.lock();
+				add_error(std::move(error));
+				error.clear();
+			}
+		}
+};
+
+#endif
+
@@ -35,6 +35,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <sys/inotify.h>
 #include <memory>
+#include <unordered_map>
 #include <filesystem>
 #include <cstring>
 
@@ -53,6 +54,8 @@ extern "C"
 #include <iostream>
 #include "gesture.h"
 #include "actiondb.h"
+#include "thread_pool.h"
+#include "config_loader.h"
 #include "input_events.hpp"
 
 static const char *default_vertex_shader_source =
@@ -584,8 +587,20 @@ class wstroke;
 class wstroke_global : public wf::plugin_interface_t
 {
 	public:
-		std::unique_ptr<const ActionDB> actions;
+		/* Current configuration. It is replaced when the configuration
+		 * is reloaded, but strokes in progress keep a reference to the
+		 * version they were started with (see wstroke::actions). */
+		std::shared_ptr<const ActionDB> actions;
 		input_headless input;
+		wf::option_wrapper_t<int> match_threads{"wstroke/match_threads"};
+		wf::option_wrapper_t<int> index_pivots{"wstroke/index_pivots"};
+		wf::option_wrapper_t<bool> usage_ordering{"wstroke/usage_ordering"};
+		wf::option_wrapper_t<int> usage_half_life{"wstroke/usage_half_life"};
+		std::unique_ptr<ThreadPool> match_pool;
+		/* number of times matching stopped early and the number of
+		 * templates that did not need to be compared due to this */
+		unsigned long n_stopped_early = 0;
+		unsigned long n_stop_skipped = 0;
 		wf::wl_idle_call idle_generate;
 
 		wstroke_global() {
@@ -593,6 +608,7 @@ class wstroke_global : public wf::plugin_interface_t
 			if(xdg_config) config_dir = std::string(xdg_config) + "/wstroke/";
 			else config_dir = std::string(getenv("HOME")) + "/.config/wstroke/";
 			config_file = config_dir + ActionDB::wstroke_actions_versions[0];
+			usage_file = config_dir + usage_file_name;
 		}
 		
 		~wstroke_global() { fini(); }
@@ -605,10 +621,17 @@ class wstroke_global : public wf::plugin_interface_t
 			});
 
 			inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+			usage.read(usage_file);
+			/* note: if this fails, the configuration is loaded on the main thread */
+			if(loader.start())
+				loader_source = wl_event_loop_add_fd(wf::get_core().ev_loop, loader.fd(), WL_EVENT_READABLE,
+					config_loaded, this);
 			reload_config();
 			inotify_source = wl_event_loop_add_fd(wf::get_core().ev_loop, inotify_fd, WL_EVENT_READABLE,
 				config_updated, this);
 
+			wf::get_core().connect(&on_view_unmapped);
+
 			auto& ol = wf::get_core().output_layout;
 			ol->connect(&on_output_added);
 			ol->connect(&on_output_removed);
@@ -616,16 +639,85 @@ class wstroke_global : public wf::plugin_interface_t
 			for(auto wo : ol->get_outputs()) handle_new_output(wo);
 		}
 
+		/* thread pool for matching strokes, or nullptr if matching
+		 * should be done on the main thread only */
+		ThreadPool* get_match_pool() {
+			int n = match_threads;
+			if(n <= 1) match_pool.reset();
+			else if(!match_pool || match_pool->size() != (unsigned int)n)
+				match_pool = std::make_unique<ThreadPool>(n);
+			return match_pool.get();
+		}
+
+		/* Whether strokes are excluded for a view, and the list of
+		 * strokes to match against for it. This is looked up by the app
+		 * ID only the first time for each view (and after its app ID
+		 * changes or the configuration is reloaded). */
+		struct view_matcher_t {
+			bool excluded = false;
+			const ActionListDiff<false>* matcher = nullptr;
+			bool valid = false;
+			/* marks this as not valid if the app ID of the view changes */
+			wf::signal::connection_t<wf::view_app_id_changed_signal> on_app_id_changed = [this] (wf::view_app_id_changed_signal*) {
+				valid = false;
+			};
+		};
+		const view_matcher_t& get_view_matcher(wayfire_view view) {
+			auto& m = view_matchers[view.get()];
+			if(!m) {
+				m = std::make_unique<view_matcher_t>();
+				view->connect(&m->on_app_id_changed);
+			}
+			if(!m->valid) {
+				const std::string& app_id = view->get_app_id();
+				LOGD("Target app id: ", app_id);
+				m->excluded = actions->exclude_app(app_id);
+				m->matcher = actions->get_matcher(app_id);
+				m->valid = true;
+			}
+			return *m;
+		}
+		
+		/* usage counts to use for matching, or nullptr if disabled */
+		const UsageStats* get_usage() {
+			if(!usage_ordering) return nullptr;
+			usage.set_half_life(86400.0 * std::max((int)usage_half_life, 0));
+			return &usage;
+		}
+		
+		/* count that the gesture with this ID was recognized */
+		void record_usage(stroke_id id) {
+			if(!get_usage()) return;
+			usage.record(id);
+			if(++usage_unsaved >= usage_save_interval) save_usage();
+		}
+
 		void fini() {
 			on_output_added.disconnect();
 			on_output_removed.disconnect();
+			on_view_unmapped.disconnect();
+			view_matchers.clear();
 
 			// for (auto& [output, inst] : output_instance) inst->fini();
 			output_instance.clear();
 
 			input.fini();
 
+			if(loader_source) {
+				wl_event_source_remove(loader_source);
+				loader_source = nullptr;
+			}
+			/* note: this waits if the configuration is being loaded */
+			bool usage_pending = (bool)loader.stop();
+			log_loader_errors();
+
 			actions.reset();
+			match_pool.reset();
+			/* the loader thread is stopped, save the counts directly (a
+			 * copy given to it that it did not save yet is newer than
+			 * the file, but not newer than usage) */
+			if(usage_unsaved || usage_pending) write_usage(usage, usage_file);
+			usage_unsaved = 0;
 			if(inotify_source) {
 				wl_event_source_remove(inotify_source);
 				inotify_source = nullptr;
@@ -642,9 +734,45 @@ class wstroke_global : public wf::plugin_interface_t
 		int inotify_fd = -1;
 		struct wl_event_source* inotify_source = nullptr;
 		static constexpr size_t inotify_buffer_size = 10*(sizeof(struct inotify_event) + NAME_MAX + 1);
-		char inotify_buffer[inotify_buffer_size];
+		alignas(struct inotify_event) char inotify_buffer[inotify_buffer_size];
+		
+		/* counts of how often each gesture was recognized; these are
+		 * saved after every usage_save_interval gestures (by the loader
+		 * thread, see save_usage()) and on exit */
+		UsageStats usage;
+		static constexpr const char* usage_file_name = "usage";
+		static constexpr const char* usage_tmp_name = "usage.tmp"; /* see UsageStats::write() */
+		static constexpr unsigned int usage_save_interval = 10;
+		std::string usage_file;
+		unsigned int usage_unsaved = 0;
+		
+		/* returns an error message (empty on success); can run on any thread */
+		static std::string write_usage_error(const UsageStats& u, const std::string& file_name) {
+			if(u.write(file_name)) return std::string();
+			return "Could not save gesture usage counts to " + file_name;
+		}
+		static void write_usage(const UsageStats& u, const std::string& file_name) {
+			std::string error = write_usage_error(u, file_name);
+			if(!error.empty()) LOGW(error);
+		}
+		
+		/* save a copy of the current counts on the loader thread, so that
+		 * the file is not written while handling input */
+		void save_usage() {
+			usage_unsaved = 0;
+			if(loader.running()) loader.request_save(std::make_unique<UsageStats>(usage));
+			else write_usage(usage, usage_file);
+		}
 		
 		std::map<wf::output_t*, std::unique_ptr<wstroke>> output_instance;
+		
+		/* cached results of get_view_matcher(); entries are removed when
+		 * the view is unmapped (so before it could be destroyed) */
+		std::unordered_map<wf::view_interface_t*, std::unique_ptr<view_matcher_t>> view_matchers;
+		wf::signal::connection_t<wf::view_unmapped_signal> on_view_unmapped = [=] (wf::view_unmapped_signal *ev) {
+			view_matchers.erase(ev->view.get());
+		};
+		
 		wf::signal::connection_t<wf::output_added_signal> on_output_added = [=] (wf::output_added_signal *ev) {
 			handle_new_output(ev->output);
 		};
@@ -657,14 +785,32 @@ class wstroke_global : public wf::plugin_interface_t
 
 		void handle_output_removed(wf::output_t *output);
 		
-		/* load / reload the configuration; also set up a watch for changes */
-		void reload_config() {
+		/* Loading the configuration and saving the usage counts is done
+		 * on a separate thread (see ConfigLoader); when a new version is
+		 * loaded, the main thread takes it in config_loaded(). */
+		ConfigLoader loader{[this] (unsigned int n_pivots, std::string& error) { return load_actions(n_pivots, error); },
+			[this] (const UsageStats& u, std::string& error) { error = write_usage_error(u, usage_file); }};
+		struct wl_event_source* loader_source = nullptr;
+		
+		/* errors are not logged on the loader thread, but passed back to
+		 * the main thread (it is not known if logging is thread-safe) */
+		void log_loader_errors() {
+			for(const std::string& error : loader.take_errors()) LOGW(error);
+		}
+		
+		/* read the configuration and prepare it for matching; returns
+		 * nullptr if it could not be read, with the reason in error
+		 * (can run on any thread) */
+		ActionDB* load_actions(unsigned int n_pivots, std::string& error) {
 			ActionDB* actions_tmp = new ActionDB();
 			if(actions_tmp) {
 				bool config_read = false;
 				try {
 					std::error_code ec;
-					if(std::filesystem::exists(config_file, ec) && std::filesystem::is_regular_file(config_file, ec))
+					/* use the compiled version if it is up to date, it is much faster to load */
+					if(actions_tmp->read_compiled(config_file + ActionDB::compiled_suffix, config_file))
+						config_read = true;
+					else if(std::filesystem::exists(config_file, ec) && std::filesystem::is_regular_file(config_file, ec))
 						config_read = actions_tmp->read(config_file, true);
 					else {
 						std::string config_file_old = config_dir + ActionDB::wstroke_actions_versions[1];
@@ -672,23 +818,70 @@ class wstroke_global : public wf::plugin_interface_t
 					}
 				}
 				catch(std::exception& e) {
-					LOGE(e.what());
+					error = std::string("Error reading the configuration file: ") + e.what() + ". ";
 				}
 				if(!config_read) {
-					LOGW("Could not find configuration file. Run the wstroke-config program first to assign actions to gestures.");
+					error += "Could not find configuration file. Run the wstroke-config program first to assign actions to gestures.";
 					delete actions_tmp;
+					return nullptr;
 				}
-				else actions.reset(actions_tmp);
+				actions_tmp->build_match_tables();
+				if(n_pivots > 0) actions_tmp->build_index(n_pivots);
+			}
+			return actions_tmp;
+		}
+		
+		/* use a newly loaded configuration (on the main thread) */
+		void set_actions(std::unique_ptr<ActionDB> tmp) {
+			if(!tmp) return;
+			actions = std::move(tmp);
+			/* note: this keeps the connections to the views */
+			for(auto& x : view_matchers) x.second->valid = false;
+		}
+		
+		static int config_loaded(int fd, uint32_t mask, void* ptr) {
+			wstroke_global* w = (wstroke_global*)ptr;
+			w->set_actions(w->loader.take_loaded());
+			w->log_loader_errors();
+			return 0;
+		}
+		
+		/* load / reload the configuration; also set up a watch for changes */
+		void reload_config() {
+			unsigned int n_pivots = std::max((int)index_pivots, 0);
+			if(loader.running()) loader.request_load(n_pivots);
+			else {
+				std::string error;
+				set_actions(std::unique_ptr<ActionDB>(load_actions(n_pivots, error)));
+				if(!error.empty()) LOGW(error);
 			}
 			if(inotify_fd >= 0) {
-				inotify_add_watch(inotify_fd, config_dir.c_str(), IN_CREATE | IN_MOVED_TO);
+				inotify_add_watch(inotify_fd, config_dir.c_str(), IN_CREATE | IN_MOVED_TO | IN_DELETE);
 				inotify_add_watch(inotify_fd, config_file.c_str(), IN_CLOSE_WRITE);
 			}
 		}
 		
 		void handle_config_updated() {
-			while(read(inotify_fd, inotify_buffer, inotify_buffer_size) > 0) { }
-			reload_config();
+			/* the usage file (and the temporary file used for writing it)
+			 * is in the same directory, but it does not affect the
+			 * configuration; deleting it resets the counts */
+			bool reload = false;
+			ssize_t len;
+			while((len = read(inotify_fd, inotify_buffer, inotify_buffer_size)) > 0) {
+				for(char* p = inotify_buffer; p < inotify_buffer + len; ) {
+					const struct inotify_event* ev = (const struct inotify_event*)p;
+					p += sizeof(struct inotify_event) + ev->len;
+					if(ev->len && !strcmp(ev->name, usage_tmp_name)) continue; /* see save_usage() */
+					if(ev->len && !strcmp(ev->name, usage_file_name)) {
+						if(ev->mask & IN_DELETE) {
+							usage.reset();
+							usage_unsaved = 0;
+						}
+					}
+					else if(!(ev->mask & IN_DELETE)) reload = true;
+				}
+			}
+			if(reload) reload_config();
 		}
 		
 		static int config_updated(int fd, uint32_t mask, void* ptr) {
@@ -709,6 +902,17 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 		wf::option_wrapper_t<std::string> resize_edges{"wstroke/resize_edges"};
 		wf::option_wrapper_t<double> touchpad_scroll_sensitivity{"wstroke/touchpad_scroll_sensitivity"};
 		wf::option_wrapper_t<int> touchpad_pinch_sensitivity{"wstroke/touchpad_pinch_sensitivity"};
+		wf::option_wrapper_t<std::string> matcher_engine{"wstroke/matcher"};
+		wf::option_wrapper_t<std::string> matcher_prefilter{"wstroke/prefilter"};
+		wf::option_wrapper_t<double> matcher_prefilter_tolerance{"wstroke/prefilter_tolerance"};
+		wf::option_wrapper_t<int> max_points{"wstroke/max_points"};
+		wf::option_wrapper_t<int> incremental_budget{"wstroke/incremental_budget"};
+		wf::option_wrapper_t<double> index_tolerance{"wstroke/index_tolerance"};
+		wf::option_wrapper_t<int> coarse_top_k{"wstroke/coarse_top_k"};
+		wf::option_wrapper_t<double> coarse_margin{"wstroke/coarse_margin"};
+		wf::option_wrapper_t<bool> stop_early{"wstroke/stop_early"};
+		wf::option_wrapper_t<double> stop_early_score{"wstroke/stop_early_score"};
+		wf::option_wrapper_t<double> stop_early_margin{"wstroke/stop_early_margin"};
 		
 		/** Grab interface to track input while a stroke is being drawn. This means
 		 * that input is not passed to underlying surfaces (they are notified of
@@ -743,7 +947,16 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			.cancel = [this]() { cancel_stroke(); }
 		};
 		
-		Stroke::PreStroke ps;
+		/* points used for matching; the on-screen trail is drawn with
+		 * all points as they arrive, not only the ones kept here */
+		PreStrokeSampler ps;
+		/* the finished stroke; kept between gestures to reuse its memory */
+		Stroke stroke;
+		/* configuration used for the current stroke, kept until it is
+		 * finished even if the configuration is reloaded in the meantime */
+		std::shared_ptr<const ActionDB> actions;
+		/* matching done while the stroke is drawn */
+		IncrementalMatcher incremental;
 		wf::wl_idle_call idle_generate;
 		wayfire_view target_view;
 		wayfire_view initial_active_view;
@@ -1084,13 +1297,10 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			
 			target_view = target_mouse ? mouse_view : initial_active_view;
 			
-			if(target_view) {
-				const std::string& app_id = target_view->get_app_id();
-				if(parent->actions->exclude_app(app_id)) {
-					LOGD("Excluding strokes for app: ", app_id);
-					if(initial_active_view != mouse_view) check_focus_mouse_view();
-					return false;
-				}
+			if(target_view && parent->get_view_matcher(target_view).excluded) {
+				LOGD("Excluding strokes for app: ", target_view->get_app_id());
+				if(initial_active_view != mouse_view) check_focus_mouse_view();
+				return false;
 			}
 			
 			/* listen to views being unmapped to handle the case when
@@ -1104,7 +1314,9 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			}
 			
 			active = true;
-			ps.push_back(Stroke::Point{(double)x, (double)y});
+			actions = parent->actions;
+			ps.set_max_points(std::max((int)max_points, 0));
+			ps.add(Stroke::Point{(double)x, (double)y});
 			return true;
 		}
 		
@@ -1122,6 +1334,10 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 					is_gesture = true;
 					input_grab->grab_input(wf::scene::layer::OVERLAY);
 					start_drawing();
+					if(incremental_budget > 0) {
+						MatchOptions opts = get_match_options();
+						if(IncrementalMatcher::supports(opts)) incremental.start(get_matcher(), opts);
+					}
 					if(target_mouse && target_view && target_view != initial_active_view) {
 						const std::string& mode = focus_mode;
 						if(mode == "always" || mode == "only_gesture") needs_refocus = false;
@@ -1133,9 +1349,10 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 					}
 				}
 			}
-			ps.push_back(t);
-			if(is_gesture) overlay_node->draw_line(ps[ps.size()-2].x, ps[ps.size()-2].y,
-				ps.back().x, ps.back().y);
+			Stroke::Point prev = ps.back();
+			ps.add(t);
+			if(is_gesture) overlay_node->draw_line(prev.x, prev.y, t.x, t.y);
+			if(is_gesture && incremental.active()) incremental.update(ps.points(), incremental_budget);
 			if(timeout.is_connected()) {
 				timeout.disconnect();
 				int timeout_len = end_timeout > 0 ? end_timeout : start_timeout;
@@ -1143,11 +1360,44 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			}
 		}
 		
+		/* list of strokes to match against for the current target view */
+		const ActionListDiff<false>* get_matcher() {
+			if(!target_view) return actions->get_root();
+			if(actions == parent->actions) return parent->get_view_matcher(target_view).matcher;
+			/* the configuration was reloaded during this stroke */
+			return actions->get_matcher(target_view->get_app_id());
+		}
+		
+		MatchOptions get_match_options() {
+			MatchOptions opts;
+			const std::string& engine = matcher_engine;
+			if(engine == "fast") opts.engine = Stroke::Engine::Fast;
+			else if(engine == "quantized") opts.engine = Stroke::Engine::Quantized;
+			else if(engine == "protractor") opts.engine = Stroke::Engine::Protractor;
+			const std::string& prefilter = matcher_prefilter;
+			if(prefilter == "none") opts.prefilter = MatchOptions::Prefilter::None;
+			else if(prefilter == "heuristic") opts.prefilter = MatchOptions::Prefilter::Heuristic;
+			opts.prefilter_tolerance = matcher_prefilter_tolerance;
+			opts.pool = parent->get_match_pool();
+			opts.coarse_top_k = std::max((int)coarse_top_k, 0);
+			opts.coarse_margin = coarse_margin;
+			opts.usage = parent->get_usage();
+			opts.stop_early = stop_early;
+			opts.stop_score = stop_early_score;
+			opts.stop_margin = stop_early_margin;
+			if(!actions->get_index().empty()) {
+				opts.index = &actions->get_index();
+				opts.index_tolerance = index_tolerance;
+			}
+			return opts;
+		}
+		
 		/* start drawing the stroke on the screen */
 		void start_drawing() {
 			wf::scene::add_front(output->node_for_layer(wf::scene::layer::OVERLAY), overlay_node);
-			for(size_t i = 1; i < ps.size(); i++)
-				overlay_node->draw_line(ps[i-1].x, ps[i-1].y, ps[i].x, ps[i].y);
+			const auto& points = ps.points();
+			for(size_t i = 1; i < points.size(); i++)
+				overlay_node->draw_line(points[i-1].x, points[i-1].y, points[i].x, points[i].y);
 		}
 		
 		/* callback when the mouse button is released */
@@ -1160,20 +1410,25 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			if(is_gesture) {
 				overlay_node->clear_lines();
 				wf::scene::remove_child(overlay_node);
-				Stroke stroke(ps);
 				/* try to match the stroke, write out match */
-				const ActionListDiff<false>* matcher = nullptr;
-				if(target_view) {
-					const std::string& app_id = target_view->get_app_id();
-					LOGD("Target app id: ", app_id);
-					matcher = parent->actions->get_action_list(app_id);
-				}
-				if(!matcher) matcher = parent->actions->get_root();
-				
 				Ranking rr;
-				Action* action = matcher->handle(stroke, &rr);
+				Action* action;
+				if(incremental.active())
+					action = incremental.finish(ps.points(), &rr);
+				else {
+					stroke.assign(ps.points());
+					action = get_matcher()->handle(stroke, &rr, get_match_options());
+				}
+				LOGD("Compared ", rr.n_compared, " gestures, skipped ", rr.n_pruned);
+				if(rr.truncated) {
+					parent->n_stopped_early++;
+					parent->n_stop_skipped += rr.n_skipped;
+					LOGD("Stopped early, not considering ", rr.n_skipped, " gestures (",
+						parent->n_stopped_early, " times, ", parent->n_stop_skipped, " gestures in total)");
+				}
 				if(action) {
-					LOGD("Matched stroke: ", rr.name);
+					LOGD("Matched stroke: ", rr.get_name());
+					parent->record_usage(rr.id);
 					action->visit(this);
 				}
 				else LOGD("Unmatched stroke");
@@ -1182,6 +1437,7 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 					 * focused view is refocused (if possible) */
 					set_idle_action([](){});
 				else if(!needs_refocus2) view_unmapped.disconnect();
+				incremental.reset();
 				is_gesture = false;
 			}
 			else {
@@ -1207,6 +1463,7 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			}
 			ps.clear();
 			active = false;
+			actions.reset();
 		}
 		
 		/* helpers for the ignore action */
@@ -1393,10 +1650,12 @@ class wstroke : public wf::per_output_plugin_instance_t, public wf::pointer_inte
 			if(is_gesture) {
 				overlay_node->clear_lines();
 				wf::scene::remove_child(overlay_node);
+				incremental.reset();
 				is_gesture = false;
 			}
 			if(target_mouse) wf::get_core().seat->focus_view(initial_active_view);
 			active = false;
+			actions.reset();
 			ptr_moved = false;
 			timeout.disconnect();
 			view_unmapped.disconnect();
@@ -25,17 +25,172 @@
 
 BOOST_CLASS_EXPORT(Stroke)
 
+static inline double point_dist(const Stroke::Point& a, const Stroke::Point& b) {
+	return hypot(a.x - b.x, a.y - b.y);
+}
+
+void PreStrokeSampler::add(const Stroke::Point& p) {
+	size_t n = ps.size();
+	/* the last point is replaced if it is too close to the one before */
+	if (n >= 2 && point_dist(ps[n-2], ps[n-1]) < min_dist)
+		ps.back() = p;
+	else
+		ps.push_back(p);
+	if (max_points && ps.size() > max_points)
+		thin_out();
+}
+
+void PreStrokeSampler::thin_out() {
+	double length = 0.0;
+	for (size_t i = 1; i < ps.size(); i++)
+		length += point_dist(ps[i-1], ps[i]);
+	/* with this distance, at most max_points / 2 + 2 points remain */
+	min_dist = std::max(2.0 * min_dist, length / (max_points / 2));
+	size_t j = 0;
+	for (size_t i = 1; i + 1 < ps.size(); i++)
+		if (point_dist(ps[j], ps[i]) >= min_dist)
+			ps[++j] = ps[i];
+	if (j > 0 && point_dist(ps[j], ps.back()) < min_dist)
+		j--;
+	ps[++j] = ps.back();
+	ps.resize(j + 1);
+}
+
 Stroke::Stroke(const PreStroke &ps) : stroke(nullptr, stroke_deleter()) {
-	if (ps.size() >= 2) {
-		stroke_t *s = stroke_alloc(ps.size());
-		for (const auto& t : ps)
-			stroke_add_point(s, t.x, t.y);
-		stroke_finish(s);
-		stroke.reset(s);
+	assign(ps);
+}
+
+void Stroke::assign(const PreStroke &ps) {
+	if (ps.size() < 2) {
+		stroke.reset();
+		reset_prepared();
+		return;
 	}
+	if (stroke && !stroke_reset(stroke.get(), ps.size()))
+		stroke.reset();
+	if (!stroke)
+		stroke.reset(stroke_alloc(ps.size()));
+	for (const auto& t : ps)
+		stroke_add_point(stroke.get(), t.x, t.y);
+	stroke_finish(stroke.get());
+	update_prepared();
 }
 
-int Stroke::compare(const Stroke& a, const Stroke& b, double &score) {
+/* reuse the same workspace for all comparisons done on one thread */
+static stroke_compare_ctx_t *get_compare_ctx() {
+	struct ctx_deleter {
+		void operator()(stroke_compare_ctx_t* ctx) const { stroke_compare_ctx_free(ctx); }
+	};
+	static thread_local std::unique_ptr<stroke_compare_ctx_t, ctx_deleter> ctx(stroke_compare_ctx_alloc());
+	return ctx.get();
+}
+
+int Stroke::compare_many(const Stroke& query, const std::vector<const stroke_t*>& templates,
+		std::vector<stroke_score_t>& scores, int flags) {
+	int n = templates.size();
+	scores.resize(n);
+	if (!query.stroke) {
+		for (int i = 0; i < n; i++)
+			scores[i] = stroke_score_t{stroke_infinity, 0.0, 1, i};
+		return -1;
+	}
+	stroke_compare_ctx_t *ctx = get_compare_ctx();
+	return ctx ? stroke_compare_many_ctx(ctx, query.stroke.get(), templates.data(), n, scores.data(), flags) :
+		stroke_compare_many(query.stroke.get(), templates.data(), n, scores.data(), flags);
+}
+
+double Stroke::compare_coarse(const Stroke& a, const Stroke& b) {
+	if (!a.stroke || !b.stroke)
+		return 0.0;
+	const CoarseMatcher::Prepared *pa = a.coarse.get(a.stroke.get());
+	const CoarseMatcher::Prepared *pb = pa ? b.coarse.get(b.stroke.get()) : nullptr;
+	if (!pa || !pb)
+		return 0.0;
+	double cost = CoarseMatcher::compare(*pa, *pb);
+	if (cost >= stroke_infinity)
+		return 0.0;
+	return std::max(1.0 - 2.5*cost, 0.0);
+}
+
+/* Douglas-Peucker simplification: mark the points between i and j that
+ * need to be kept so that no point is farther than eps from the result */
+static void simplify_r(const Stroke::PreStroke& ps, size_t i, size_t j, double eps, std::vector<bool>& keep) {
+	if (j <= i + 1)
+		return;
+	double dx = ps[j].x - ps[i].x;
+	double dy = ps[j].y - ps[i].y;
+	double len = hypot(dx, dy);
+	double max_dist = -1.0;
+	size_t max_k = i;
+	for (size_t k = i + 1; k < j; k++) {
+		double ex = ps[k].x - ps[i].x;
+		double ey = ps[k].y - ps[i].y;
+		double dist = (len > 0.0) ? fabs(ex * dy - ey * dx) / len : hypot(ex, ey);
+		if (dist > max_dist) {
+			max_dist = dist;
+			max_k = k;
+		}
+	}
+	if (max_dist <= eps)
+		return;
+	keep[max_k] = true;
+	simplify_r(ps, i, max_k, eps, keep);
+	simplify_r(ps, max_k, j, eps, keep);
+}
+
+static Stroke::PreStroke simplify_points(const Stroke::PreStroke& ps, double eps) {
+	std::vector<bool> keep(ps.size(), false);
+	keep.front() = true;
+	keep.back() = true;
+	simplify_r(ps, 0, ps.size() - 1, eps, keep);
+	Stroke::PreStroke ret;
+	for (size_t i = 0; i < ps.size(); i++)
+		if (keep[i])
+			ret.push_back(ps[i]);
+	return ret;
+}
+
+Stroke Stroke::simplify(double min_score) const {
+	unsigned int n = size();
+	if (n <= 3)
+		return clone();
+	PreStroke ps;
+	for (unsigned int i = 0; i < n; i++)
+		ps.push_back(points(i));
+	/* points are normalized to the unit square; if even a very small
+	 * tolerance removes nothing, the stroke is already simple enough */
+	const double eps_min = 0.001;
+	PreStroke best = simplify_points(ps, eps_min);
+	if (best.size() == n)
+		return clone();
+	Stroke tmp(best);
+	double score;
+	if (compare(*this, tmp, score) < 0 || score < min_score)
+		return clone();
+	/* find the largest tolerance that still gives an acceptable score */
+	double lo = eps_min, hi = 0.25;
+	for (int k = 0; k < 12; k++) {
+		double eps = (lo + hi) / 2.0;
+		PreStroke cur = simplify_points(ps, eps);
+		Stroke s(cur);
+		if (compare(*this, s, score) >= 0 && score >= min_score) {
+			lo = eps;
+			best = std::move(cur);
+		}
+		else hi = eps;
+	}
+	return Stroke(best);
+}
+
+/* compare the versions of two strokes prepared for matcher M */
+template<class M>
+static double compare_prepared(const typename M::Prepared *a, const typename M::Prepared *b, double max_cost) {
+	if (!a || !b)
+		return stroke_infinity;
+	return M::compare(*a, *b, (float)max_cost);
+}
+
+int Stroke::compare(const Stroke& a, const Stroke& b, double &score, double max_cost, Engine engine) {
 	score = 0.0;
 	if (!a.stroke || !b.stroke) {
 		if (!a.stroke && !b.stroke) {
@@ -44,7 +199,26 @@ int Stroke::compare(const Stroke& a, const Stroke& b, double &score) {
 		}
 		return -1;
 	}
-	double cost = stroke_compare(a.stroke.get(), b.stroke.get(), nullptr, nullptr);
+	double cost;
+	switch (engine) {
+		case Engine::Fast:
+			cost = compare_prepared<FastMatcher>(a.fast.get(a.stroke.get()),
+				b.fast.get(b.stroke.get()), max_cost);
+			break;
+		case Engine::Quantized:
+			cost = compare_prepared<QuantizedMatcher>(a.quantized.get(a.stroke.get()),
+				b.quantized.get(b.stroke.get()), max_cost);
+			break;
+		case Engine::Protractor:
+			cost = compare_prepared<ProtractorMatcher>(a.protractor.get(a.stroke.get()),
+				b.protractor.get(b.stroke.get()), max_cost);
+			break;
+		default: {
+			stroke_compare_ctx_t *ctx = get_compare_ctx();
+			cost = ctx ? stroke_compare_ctx_bounded(ctx, a.stroke.get(), b.stroke.get(), max_cost) :
+				stroke_compare_bounded(a.stroke.get(), b.stroke.get(), max_cost);
+		}
+	}
 	if (cost >= stroke_infinity)
 		return -1;
 	score = std::max(1.0 - 2.5*cost, 0.0);
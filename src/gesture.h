@@ -18,8 +18,10 @@
 #define __GESTURE_H__
 
 #include "stroke.h"
+#include "stroke_match.h"
 #include <vector>
 #include <memory>
+#include <atomic>
 #include <boost/shared_ptr.hpp>
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/version.hpp>
@@ -46,6 +48,7 @@ class Stroke {
 			Point product = { x * a, y * a };
 			return product;
 		}
+		bool operator==(const Point &p) const { return x == p.x && y == p.y; }
 		template<class Archive> void serialize(Archive & ar, const unsigned int version) {
 			ar & x; ar & y;
 			if (version == 0) {
@@ -74,6 +77,7 @@ private:
 				stroke_finish(s);
 				stroke.reset(s);
 			}
+			reset_prepared();
 			return;
 		}
 		
@@ -86,6 +90,7 @@ private:
 			stroke_finish(s);
 			stroke.reset(s);
 		}
+		reset_prepared();
 		if (version == 0) return;
 		
 		int trigger;
@@ -116,21 +121,205 @@ private:
 	};
 	
 public:
+	/* Engines available for matching strokes:
+	 *  - Exact: the original algorithm, working on all points in double precision;
+	 *  - Fast: uses single precision and strokes resampled to fast_size points;
+	 *  - Quantized: uses all points, but reads them from a copy stored as
+	 *    16-bit integers (4 bytes per point instead of 16) and computes in
+	 *    single precision; this reduces the data read while matching, but
+	 *    the original points are still kept (in addition to this copy);
+	 *  - Protractor: a different algorithm that compares strokes resampled
+	 *    to protractor_size points in linear time (see ProtractorMatcher).
+	 * The version of a stroke needed by an engine is only created the first
+	 * time that engine is used with it, so only the engine that is actually
+	 * selected costs time and memory. */
+	enum class Engine { Exact, Fast, Quantized, Protractor };
+	static constexpr int fast_size = 64;
+	using FastMatcher = StrokeMatcher<float, fast_size>;
+	using QuantizedMatcher = StrokeMatcher<float, 0, QuantizedEncoding<float>>;
+	/* very coarse version, used for preselecting candidates */
+	static constexpr int coarse_size = 16;
+	using CoarseMatcher = StrokeMatcher<float, coarse_size>;
+	static constexpr int protractor_size = 32;
+	using ProtractorMatcher = ::ProtractorMatcher<float, protractor_size>;
+	
 	std::unique_ptr<stroke_t, stroke_deleter> stroke;
 
 	Stroke() : stroke(nullptr, stroke_deleter()) { }
 	Stroke(const PreStroke &s);
-	Stroke clone() const { Stroke s; if(stroke) s.stroke.reset(stroke_copy(stroke.get())); return s; }
+	/* Take ownership of s, which must be a finished stroke (e.g. one
+	 * created by stroke_from_data()). */
+	explicit Stroke(stroke_t* s) : stroke(s, stroke_deleter()) { }
+	/* Replace the points of this stroke by ps. The memory already used by
+	 * this stroke (also for the engine used with it) is reused, so this does
+	 * not allocate unless ps has more points than any stroke stored here
+	 * before. Use this to match strokes repeatedly with the same object. */
+	void assign(const PreStroke &ps);
+	Stroke clone() const {
+		Stroke s;
+		if(stroke) s.stroke.reset(stroke_copy(stroke.get()));
+		s.fast = fast.clone();
+		s.quantized = quantized.clone();
+		s.coarse = coarse.clone();
+		s.protractor = protractor.clone();
+		return s;
+	}
 
 	static Stroke trefoil();
-	static int compare(const Stroke&, const Stroke&, double &);
+	/* Return a simplified version of this stroke with as few points as
+	 * possible (using the Douglas-Peucker algorithm), such that its score
+	 * when compared to the original stays at least min_score. If no
+	 * points can be removed, the result is a copy of this stroke. */
+	Stroke simplify(double min_score) const;
+	/* Comparing strokes does not modify them, and each thread uses its
+	 * own workspace, so the same strokes can be compared by several
+	 * threads at the same time (as long as no thread modifies them). */
+	/* Compare two strokes, setting score to their similarity (between
+	 * 0 and 1). If max_cost is given, strokes whose matching cost would be
+	 * larger are rejected early (compare() returns -1 as if they did not
+	 * match at all); this is equivalent to a score below 1 - 2.5*max_cost. */
+	static int compare(const Stroke&, const Stroke&, double &score, double max_cost = stroke_infinity,
+		Engine engine = Engine::Exact);
+	/* Compare query to all templates (with Engine::Exact), see
+	 * stroke_compare_many() for the meaning of flags and the result.
+	 * All templates must be non-trivial. */
+	static int compare_many(const Stroke& query, const std::vector<const stroke_t*>& templates,
+		std::vector<stroke_score_t>& scores, int flags);
+	/* Score of two strokes using their coarse versions only (between 0
+	 * and 1; 0 if either is trivial or they do not match at all). */
+	static double compare_coarse(const Stroke& a, const Stroke& b);
+	/* Lower bound for the matching cost of two strokes with the Exact
+	 * engine, computed from their signatures (see stroke_lower_bound()). */
+	static double lower_bound(const Stroke& a, const Stroke& b) {
+		return (a.stroke && b.stroke) ? stroke_lower_bound(a.stroke.get(), b.stroke.get()) : 0.0;
+	}
+	/* Approximate dissimilarity (between 0 and 1), not a bound on the cost. */
+	static double signature_distance(const Stroke& a, const Stroke& b) {
+		return (a.stroke && b.stroke) ? stroke_signature_distance(a.stroke.get(), b.stroke.get()) : 0.0;
+	}
 	
 	unsigned int size() const { return stroke ? stroke_get_size(stroke.get()) : 0; }
 	bool trivial() const { return size() == 0 ; }
 	Point points(int n) const { Point p; stroke_get_point(stroke.get(), n, &p.x, &p.y); return p; }
 	double time(int n) const { return stroke_get_time(stroke.get(), n); }
+
+private:
+	/* Version of a stroke prepared for matcher M. This is created by get()
+	 * the first time it is needed, possibly by several threads comparing
+	 * the same (const) stroke at once: each of them prepares its own copy,
+	 * and the one stored first is used by everyone (the others are freed). */
+	template<class M>
+	class LazyPrepared {
+		public:
+			LazyPrepared() = default;
+			LazyPrepared(LazyPrepared&& o) noexcept : data(o.data.exchange(nullptr, std::memory_order_relaxed)) { }
+			LazyPrepared& operator=(LazyPrepared&& o) noexcept {
+				if(this != &o) {
+					reset();
+					data.store(o.data.exchange(nullptr, std::memory_order_relaxed), std::memory_order_relaxed);
+				}
+				return *this;
+			}
+			~LazyPrepared() { reset(); }
+			
+			/* prepared version of s (which this belongs to), or nullptr if
+			 * s cannot be used with M */
+			const typename M::Prepared* get(const stroke_t* s) const {
+				Data* d = data.load(std::memory_order_acquire);
+				if(!d) {
+					Data* tmp = new Data;
+					tmp->valid = M::prepare(s, tmp->p);
+					if(data.compare_exchange_strong(d, tmp, std::memory_order_acq_rel, std::memory_order_acquire)) d = tmp;
+					else delete tmp;
+				}
+				if(!d->used.load(std::memory_order_relaxed)) d->used.store(true, std::memory_order_relaxed);
+				return d->valid ? &d->p : nullptr;
+			}
+			/* s was changed: prepare it again in the same memory, but only if
+			 * it was used since the last update (i.e. M is still the engine
+			 * in use); otherwise free the memory and leave it to get() */
+			void update(const stroke_t* s) {
+				Data* d = data.load(std::memory_order_relaxed);
+				if(!d) return;
+				if(!d->used.load(std::memory_order_relaxed)) {
+					reset();
+					return;
+				}
+				d->used.store(false, std::memory_order_relaxed);
+				d->valid = M::prepare(s, d->p);
+			}
+			void reset() { delete data.exchange(nullptr, std::memory_order_relaxed); }
+			LazyPrepared clone() const {
+				LazyPrepared ret;
+				const Data* d = data.load(std::memory_order_acquire);
+				if(d) {
+					Data* tmp = new Data;
+					tmp->p = d->p;
+					tmp->valid = d->valid;
+					ret.data.store(tmp, std::memory_order_relaxed);
+				}
+				return ret;
+			}
+			
+		private:
+			struct Data {
+				typename M::Prepared p;
+				bool valid = false;
+				std::atomic<bool> used{true};
+			};
+			mutable std::atomic<Data*> data{nullptr};
+	};
+	
+	/* versions used by the engines other than Exact, created when needed */
+	LazyPrepared<FastMatcher> fast;
+	LazyPrepared<QuantizedMatcher> quantized;
+	LazyPrepared<CoarseMatcher> coarse;
+	LazyPrepared<ProtractorMatcher> protractor;
+	void reset_prepared() {
+		fast.reset();
+		quantized.reset();
+		coarse.reset();
+		protractor.reset();
+	}
+	void update_prepared() {
+		fast.update(stroke.get());
+		quantized.update(stroke.get());
+		coarse.update(stroke.get());
+		protractor.update(stroke.get());
+	}
 };
 BOOST_CLASS_VERSION(Stroke, 6)
 BOOST_CLASS_VERSION(Stroke::Point, 1)
 
+/* Collects the points of a stroke while it is drawn, keeping at most
+ * max_points of them. Points that are closer than a minimum distance to
+ * the previous one are dropped; whenever there would be too many points,
+ * the minimum distance is increased and the points already collected are
+ * thinned out, so the cost of adding a point is constant on average.
+ * The last point added is always kept as the end of the stroke. */
+class PreStrokeSampler {
+	public:
+		explicit PreStrokeSampler(unsigned int max_points_ = 0) { set_max_points(max_points_); }
+		/* 0 means no limit; otherwise, at least 4 points are kept, and
+		 * space for all of them is allocated here, so that adding points
+		 * does not allocate memory (clear() keeps this space) */
+		void set_max_points(unsigned int max_points_) {
+			max_points = (max_points_ && max_points_ < 4) ? 4 : max_points_;
+			if(max_points) ps.reserve(max_points + 1);
+		}
+		void clear() { ps.clear(); min_dist = 0.0; }
+		void add(const Stroke::Point& p);
+		
+		const Stroke::PreStroke& points() const { return ps; }
+		size_t size() const { return ps.size(); }
+		const Stroke::Point& front() const { return ps.front(); }
+		const Stroke::Point& back() const { return ps.back(); }
+		
+	private:
+		Stroke::PreStroke ps;
+		double min_dist = 0.0;
+		unsigned int max_points = 0;
+		void thin_out();
+};
+
 #endif
@@ -27,36 +27,82 @@
 const double stroke_infinity = 0.2;
 #define EPS 0.000001
 
-struct point {
-	double x;
-	double y;
-	double t;
-	double dt;
-	double alpha;
+/* Number of direction bins used for the signature of a stroke. */
+#define DIRECTIONS 16
+#define DIRECTION_WIDTH (2.0 / DIRECTIONS)
+
+/* Small summary of a stroke that can be used to quickly rule out a
+ * match without running the dynamic programming in stroke_compare(). */
+struct signature {
+	double hist[DIRECTIONS]; /* fraction of the length in each direction */
+	double gap2[DIRECTIONS]; /* squared distance of each direction from the closest one present */
+	double start_alpha; /* direction of the first and last 10% of the stroke */
+	double end_alpha;
+	double turning; /* total turning angle (in units of pi) */
+	double aspect; /* ratio of the shorter and longer side of the bounding box */
 };
 
+/* Points are stored as separate arrays: only t and alpha are used for
+ * matching, so these are kept together at the start of the allocation,
+ * while the coordinates (only needed for drawing) come after them. */
 struct _stroke_t {
 	int n;
 	int capacity;
-	struct point *p;
+	int allocated; /* size of the arrays (capacity is -1 once finished);
+	                * 0 if they are not owned (see stroke_from_data()) */
+	double *t;
+	double *alpha; /* direction of the segment starting at each point */
+	double *x;
+	double *y;
+	struct signature sig;
 };
 
+static bool stroke_alloc_arrays(stroke_t *s, int n) {
+	s->t = calloc(4 * (size_t)n, sizeof(double));
+	if (!s->t)
+		return false;
+	s->alpha = s->t + n;
+	s->x = s->alpha + n;
+	s->y = s->x + n;
+	return true;
+}
+
 stroke_t *stroke_alloc(int n) {
 	assert(n > 0);
 	stroke_t *s = malloc(sizeof(stroke_t));
 	s->n = 0;
 	s->capacity = n;
-	s->p = calloc(n, sizeof(struct point));
+	s->allocated = n;
+	stroke_alloc_arrays(s, n);
 	return s;
 }
 
+int stroke_reset(stroke_t *s, int n) {
+	assert(n > 0);
+	if (n > s->allocated) {
+		double *old = s->t;
+		if (!stroke_alloc_arrays(s, n)) {
+			s->t = old;
+			return 0;
+		}
+		if (s->allocated)
+			free(old);
+		s->allocated = n;
+	}
+	s->n = 0;
+	s->capacity = n;
+	return 1;
+}
+
 void stroke_add_point(stroke_t *s, double x, double y) {
 	assert(s->capacity > s->n);
-	s->p[s->n].x = x;
-	s->p[s->n].y = y;
+	s->x[s->n] = x;
+	s->y[s->n] = y;
 	s->n++;
 }
 
+inline static double sqr(double x) { return x*x; }
+
 static inline double angle_difference(double alpha, double beta) {
 	double d = alpha - beta;
 	if (d < -1.0)
@@ -66,60 +112,296 @@ static inline double angle_difference(double alpha, double beta) {
 	return d;
 }
 
+#ifdef STROKE_SIMD
+/* Kernels computing out[i] = sqr(angle_difference(alpha, beta[i])) for a
+ * row of the DP table (see step()). The vectorized versions do the same
+ * operations as angle_difference() (adding or subtracting 0 where it does
+ * not change d), so all of them give exactly the same results. */
+typedef void (*angle_row_func)(double alpha, const double *beta, int n, double *out);
+
+static void angle_row_scalar(double alpha, const double *beta, int n, double *out) {
+	for (int i = 0; i < n; i++)
+		out[i] = sqr(angle_difference(alpha, beta[i]));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_ANGLE_ROW_X86
+
+__attribute__((target("sse2")))
+static void angle_row_sse2(double alpha, const double *beta, int n, double *out) {
+	const __m128d a = _mm_set1_pd(alpha);
+	const __m128d one = _mm_set1_pd(1.0);
+	const __m128d minus_one = _mm_set1_pd(-1.0);
+	const __m128d two = _mm_set1_pd(2.0);
+	int i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128d d = _mm_sub_pd(a, _mm_loadu_pd(beta + i));
+		__m128d add = _mm_and_pd(_mm_cmplt_pd(d, minus_one), two);
+		__m128d sub = _mm_and_pd(_mm_cmpgt_pd(d, one), two);
+		d = _mm_sub_pd(_mm_add_pd(d, add), sub);
+		_mm_storeu_pd(out + i, _mm_mul_pd(d, d));
+	}
+	angle_row_scalar(alpha, beta + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static void angle_row_avx2(double alpha, const double *beta, int n, double *out) {
+	const __m256d a = _mm256_set1_pd(alpha);
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d minus_one = _mm256_set1_pd(-1.0);
+	const __m256d two = _mm256_set1_pd(2.0);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d d = _mm256_sub_pd(a, _mm256_loadu_pd(beta + i));
+		__m256d add = _mm256_and_pd(_mm256_cmp_pd(d, minus_one, _CMP_LT_OQ), two);
+		__m256d sub = _mm256_and_pd(_mm256_cmp_pd(d, one, _CMP_GT_OQ), two);
+		d = _mm256_sub_pd(_mm256_add_pd(d, add), sub);
+		_mm256_storeu_pd(out + i, _mm256_mul_pd(d, d));
+	}
+	angle_row_scalar(alpha, beta + i, n - i, out + i);
+}
+#endif
+
+static angle_row_func angle_row = angle_row_scalar;
+
+/* select the best kernel supported by the CPU when the library is loaded */
+__attribute__((constructor))
+static void select_angle_row(void) {
+#ifdef HAVE_ANGLE_ROW_X86
+	__builtin_cpu_init();
+	angle_row = __builtin_cpu_supports("avx2") ? angle_row_avx2 : angle_row_sse2;
+#endif
+}
+
+int stroke_set_kernel(int kernel) {
+	switch (kernel) {
+		case 0:
+			angle_row = angle_row_scalar;
+			return 1;
+#ifdef HAVE_ANGLE_ROW_X86
+		case 1:
+			if (!__builtin_cpu_supports("sse2"))
+				return 0;
+			angle_row = angle_row_sse2;
+			return 1;
+		case 2:
+			if (!__builtin_cpu_supports("avx2"))
+				return 0;
+			angle_row = angle_row_avx2;
+			return 1;
+#endif
+		default:
+			return 0;
+	}
+}
+#endif
+
+/* atan2(y, x) / pi, computed with a polynomial approximation so that
+ * loops calling it can be vectorized (unlike atan2() from libm). The
+ * polynomial is a least squares fit of atan(u) / pi on [0, tan(pi/8)]
+ * with an error of about 2.5e-15; the result differs from
+ * atan2(y, x) / M_PI by less than 1e-14 (except that atan2(+-0, -0) is
+ * +-0 here, not +-1; this case does not occur in stroke_finish()). */
+static inline double atan2_pi(double y, double x) {
+	static const double c[9] = {
+		0.31830988618378692, -0.10610329538697906, 0.063661975941387269,
+		-0.045472761285469745, 0.035365347012121968, -0.028895910763781067,
+		0.0240648201202323, -0.018656993298239968, 0.0096966962952000496 };
+	double ax = fabs(x);
+	double ay = fabs(y);
+	bool swap = ay > ax;
+	double mx = swap ? ay : ax;
+	double mn = swap ? ax : ay;
+	/* note: divisions are done unconditionally (and are always safe),
+	 * so that there are no branches here */
+	double z = mn / ((mx > 0.0) ? mx : 1.0);
+	/* reduce z from [0, 1] to [-tan(pi/8), tan(pi/8)] using
+	 * atan(z) = pi/4 + atan((z - 1) / (z + 1)) */
+	bool big = z > 0.41421356237309503;
+	double w = (z - 1.0) / (z + 1.0);
+	double u = big ? w : z;
+	double u2 = u * u;
+	double p = ((((((((c[8] * u2 + c[7]) * u2 + c[6]) * u2 + c[5]) * u2 + c[4]) * u2
+		+ c[3]) * u2 + c[2]) * u2 + c[1]) * u2 + c[0]);
+	double a = u * p + (big ? 0.25 : 0.0);
+	a = swap ? 0.5 - a : a;
+	a = (x < 0.0) ? 1.0 - a : a;
+	return copysign(a, y);
+}
+
+static inline int direction_bin(double alpha) {
+	int k = (int)floor((alpha + 1.0) / DIRECTION_WIDTH);
+	if (k < 0)
+		k = 0;
+	return k % DIRECTIONS; /* note: alpha == 1 is the same as -1 */
+}
+
+static void compute_signature(stroke_t *s, double scaleX, double scaleY) {
+	struct signature *sig = &s->sig;
+	int n = s->n - 1;
+	memset(sig, 0, sizeof(struct signature));
+
+	bool present[DIRECTIONS] = {false};
+	for (int i = 0; i < n; i++) {
+		int k = direction_bin(s->alpha[i]);
+		/* note: zero length segments are also considered to be present
+		 * since the dynamic programming may visit them */
+		present[k] = true;
+		sig->hist[k] += s->t[i+1] - s->t[i];
+	}
+	for (int k = 0; k < DIRECTIONS; k++) {
+		int gap = DIRECTIONS;
+		for (int l = 0; l < DIRECTIONS; l++) {
+			if (!present[l])
+				continue;
+			int c = abs(k - l);
+			if (DIRECTIONS - c < c)
+				c = DIRECTIONS - c;
+			if (c < gap)
+				gap = c;
+		}
+		/* any angle in bin k differs by at least (gap - 1) bins from any angle present */
+		double d = (gap > 0) ? (gap - 1) * DIRECTION_WIDTH : 0.0;
+		sig->gap2[k] = (gap < DIRECTIONS) ? sqr(d) : 0.0;
+	}
+
+	if (n > 0) {
+		int i1 = 1, i2 = n - 1;
+		while (i1 < n && s->t[i1] < 0.1)
+			i1++;
+		while (i2 > 0 && s->t[i2] > 0.9)
+			i2--;
+		sig->start_alpha = atan2_pi(s->y[i1] - s->y[0], s->x[i1] - s->x[0]);
+		sig->end_alpha = atan2_pi(s->y[n] - s->y[i2], s->x[n] - s->x[i2]);
+	}
+	/* turning angle is computed on a coarse version of the stroke, so
+	 * that it is not sensitive to small jitter in the points */
+	int prev = 0;
+	double prev_alpha = 0.0;
+	bool have_prev = false;
+	for (int k = 1; k <= DIRECTIONS && n > 0; k++) {
+		int i = prev + 1;
+		while (i < n && s->t[i] < (double)k / DIRECTIONS)
+			i++;
+		if (i > n)
+			break;
+		if (s->t[i] > s->t[prev]) {
+			double alpha = atan2_pi(s->y[i] - s->y[prev], s->x[i] - s->x[prev]);
+			if (have_prev)
+				sig->turning += fabs(angle_difference(alpha, prev_alpha));
+			prev_alpha = alpha;
+			have_prev = true;
+		}
+		prev = i;
+	}
+	double scale = (scaleX > scaleY) ? scaleX : scaleY;
+	sig->aspect = (scale > 0.0) ? ((scaleX > scaleY) ? scaleY : scaleX) / scale : 1.0;
+}
+
 void stroke_finish(stroke_t *s) {
 	assert(s->capacity > 0);
 	s->capacity = -1;
 
 	int n = s->n - 1;
-	double total = 0.0;
-	s->p[0].t = 0.0;
+	double *restrict t = s->t;
+	double *restrict alpha = s->alpha;
+	double *restrict x = s->x;
+	double *restrict y = s->y;
+
+	/* Length and direction of each segment; directions are the same
+	 * after rescaling below, so they can be computed here. There are no
+	 * dependencies between iterations, so this loop can be vectorized. */
+	t[0] = 0.0;
 	for (int i = 0; i < n; i++) {
-		total += hypot(s->p[i+1].x - s->p[i].x, s->p[i+1].y - s->p[i].y);
-		s->p[i+1].t = total;
+		double dx = x[i+1] - x[i];
+		double dy = y[i+1] - y[i];
+		t[i+1] = sqrt(dx*dx + dy*dy);
+		alpha[i] = atan2_pi(dy, dx);
 	}
-	for (int i = 0; i <= n; i++)
-		s->p[i].t /= total;
-	double minX = s->p[0].x, minY = s->p[0].y, maxX = minX, maxY = minY;
+	/* cumulative length and bounding box */
+	double total = 0.0;
+	double minX = x[0], minY = y[0], maxX = minX, maxY = minY;
 	for (int i = 1; i <= n; i++) {
-		if (s->p[i].x < minX) minX = s->p[i].x;
-		if (s->p[i].x > maxX) maxX = s->p[i].x;
-		if (s->p[i].y < minY) minY = s->p[i].y;
-		if (s->p[i].y > maxY) maxY = s->p[i].y;
+		total += t[i];
+		t[i] = total;
+		if (x[i] < minX) minX = x[i];
+		if (x[i] > maxX) maxX = x[i];
+		if (y[i] < minY) minY = y[i];
+		if (y[i] > maxY) maxY = y[i];
 	}
 	double scaleX = maxX - minX;
 	double scaleY = maxY - minY;
 	double scale = (scaleX > scaleY) ? scaleX : scaleY;
 	if (scale < 0.001) scale = 1;
+	double cx = (minX+maxX)/2;
+	double cy = (minY+maxY)/2;
 	for (int i = 0; i <= n; i++) {
-		s->p[i].x = (s->p[i].x-(minX+maxX)/2)/scale + 0.5;
-		s->p[i].y = (s->p[i].y-(minY+maxY)/2)/scale + 0.5;
-	}
-
-	for (int i = 0; i < n; i++) {
-		s->p[i].dt = s->p[i+1].t - s->p[i].t;
-		s->p[i].alpha = atan2(s->p[i+1].y - s->p[i].y, s->p[i+1].x - s->p[i].x)/M_PI;
+		t[i] /= total;
+		x[i] = (x[i]-cx)/scale + 0.5;
+		y[i] = (y[i]-cy)/scale + 0.5;
 	}
 
+	compute_signature(s, scaleX, scaleY);
 }
 
 void stroke_free(stroke_t *s) {
-	if (s)
-		free(s->p);
+	if (s && s->allocated)
+		free(s->t);
 	free(s);
 }
 
+/* the signature is stored as doubles at the start of the data */
+#define SIGNATURE_DOUBLES (sizeof(struct signature) / sizeof(double))
+_Static_assert(sizeof(struct signature) % sizeof(double) == 0, "signature should only contain doubles");
+
+size_t stroke_data_size(int n) {
+	return SIGNATURE_DOUBLES + 4 * (size_t)n;
+}
+
+void stroke_get_data(const stroke_t *s, double *data) {
+	size_t n = s->n;
+	memcpy(data, &s->sig, sizeof(struct signature));
+	data += SIGNATURE_DOUBLES;
+	memcpy(data, s->t, n * sizeof(double));
+	memcpy(data + n, s->alpha, n * sizeof(double));
+	memcpy(data + 2*n, s->x, n * sizeof(double));
+	memcpy(data + 3*n, s->y, n * sizeof(double));
+}
+
+stroke_t *stroke_from_data(int n, const double *data) {
+	assert(n > 0);
+	stroke_t *s = malloc(sizeof(stroke_t));
+	if (!s)
+		return NULL;
+	s->n = n;
+	s->capacity = -1;
+	s->allocated = 0;
+	memcpy(&s->sig, data, sizeof(struct signature));
+	/* note: the arrays are never written to, since the stroke is finished */
+	s->t = (double *)data + SIGNATURE_DOUBLES;
+	s->alpha = s->t + n;
+	s->x = s->alpha + n;
+	s->y = s->x + n;
+	return s;
+}
+
 stroke_t *stroke_copy(const stroke_t *stroke) {
 	if(!stroke) return NULL;
 	stroke_t *s = malloc(sizeof(stroke_t));
 	if(!s) return NULL;
-	s->p = calloc(stroke->n, sizeof(struct point));
-	if(!(s->p)) {
+	if(!stroke_alloc_arrays(s, stroke->n)) {
 		free(s);
 		return NULL;
 	}
 	s->n = stroke->n;
 	s->capacity = s->n;
-	memcpy(s->p, stroke->p, s->n * sizeof(struct point));
+	s->allocated = s->n;
+	memcpy(s->t, stroke->t, s->n * sizeof(double));
+	memcpy(s->alpha, stroke->alpha, s->n * sizeof(double));
+	memcpy(s->x, stroke->x, s->n * sizeof(double));
+	memcpy(s->y, stroke->y, s->n * sizeof(double));
+	s->sig = stroke->sig;
 	return s;
 }
 
@@ -129,33 +411,109 @@ int stroke_get_size(const stroke_t *s) { return s->n; }
 void stroke_get_point(const stroke_t *s, int n, double *x, double *y) {
 	assert(n < s->n);
 	if (x)
-		*x = s->p[n].x;
+		*x = s->x[n];
 	if (y)
-		*y = s->p[n].y;
+		*y = s->y[n];
 }
 
 double stroke_get_time(const stroke_t *s, int n) {
 	assert(n < s->n);
-	return s->p[n].t;
+	return s->t[n];
 }
 
 double stroke_get_angle(const stroke_t *s, int n) {
 	assert(n+1 < s->n);
-	return s->p[n].alpha;
+	return s->alpha[n];
 }
 
-inline static double sqr(double x) { return x*x; }
-
 double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int j) {
 	return fabs(angle_difference(stroke_get_angle(a, i), stroke_get_angle(b, j)));
 }
 
+/* Lower bound for the cost of matching the directions of a to b. In each
+ * step of the dynamic programming, the angle difference is integrated over
+ * the parameter of both strokes, and since the slope of the step is above
+ * 1/2.2, the cost is at least (1 + 1/2.2) times the integral over a's
+ * parameter only. At any point, the squared angle difference is at least
+ * the squared distance of a's direction from the closest direction that
+ * is present in b, which we can bound from the direction bins. */
+static double lower_bound_dir(const struct signature *a, const struct signature *b) {
+	double lb = 0.0;
+	for (int k = 0; k < DIRECTIONS; k++)
+		lb += a->hist[k] * b->gap2[k];
+	return (1.0 + 1.0 / 2.2) * lb;
+}
+
+/* Margin for the lower bound to cover rounding in the dynamic programming
+ * and the small part of a step that can be skipped at its end (EPS). */
+#define LOWER_BOUND_MARGIN 1e-5
+
+double stroke_lower_bound(const stroke_t *a, const stroke_t *b) {
+	double lb1 = lower_bound_dir(&a->sig, &b->sig);
+	double lb2 = lower_bound_dir(&b->sig, &a->sig);
+	double lb = ((lb1 > lb2) ? lb1 : lb2) - LOWER_BOUND_MARGIN;
+	return (lb > 0.0) ? lb : 0.0;
+}
+
+double stroke_signature_distance(const stroke_t *a, const stroke_t *b) {
+	const struct signature *sa = &a->sig;
+	const struct signature *sb = &b->sig;
+	double d = fabs(angle_difference(sa->start_alpha, sb->start_alpha));
+	double tmp = fabs(angle_difference(sa->end_alpha, sb->end_alpha));
+	if (tmp > d)
+		d = tmp;
+	tmp = fabs(sa->turning - sb->turning) / 4.0;
+	if (tmp > d)
+		d = tmp;
+	tmp = fabs(sa->aspect - sb->aspect);
+	if (tmp > d)
+		d = tmp;
+	return d;
+}
+
+/* Storage for the dynamic programming table used by stroke_compare().
+ * Only the cells inside a diagonal corridor are stored: row x contains
+ * the cells lo[x] <= y <= hi[x], at dist[off[x] + y - lo[x]]. */
+struct dp_band {
+	double *dist;
+	int *prev_x;
+	int *prev_y;
+	double *row_min; /* smallest distance stored in each row so far */
+	/* number of rows whose row_min is at most max_cost (counting only
+	 * the rows not processed yet, see compare_internal()) */
+	int alive_rows;
+	double max_cost;
+	const int *lo;
+	const int *hi;
+	const int *off;
+#ifdef STROKE_SIMD
+	double *ad; /* squared angle differences for the cells in the band */
+	int ad_rows; /* number of rows of ad computed so far */
+#endif
+};
+
+static inline int band_index(const struct dp_band *band, int x, int y) {
+	if (y < band->lo[x] || y > band->hi[x])
+		return -1;
+	return band->off[x] + y - band->lo[x];
+}
+
+/* Squared angle difference for cell (i, j); with STROKE_SIMD, this is
+ * computed in advance for the rows of the band already reached. */
+static inline double angle_cost(const stroke_t *a, const stroke_t *b, const struct dp_band *band, int i, int j) {
+#ifdef STROKE_SIMD
+	/* cells on the way between two cells of the band can be outside of it */
+	if (j >= band->lo[i] && j <= band->hi[i])
+		return band->ad[band->off[i] + j - band->lo[i]];
+#else
+	(void)band;
+#endif
+	return sqr(angle_difference(a->alpha[i], b->alpha[j]));
+}
+
 static inline void step(const stroke_t *a,
 			const stroke_t *b,
-			const int N,
-			double *dist,
-			int *prev_x,
-			int *prev_y,
+			struct dp_band *band,
 			const int x,
 			const int y,
 			const double tx,
@@ -164,20 +522,34 @@ static inline void step(const stroke_t *a,
 			const int x2,
 			const int y2)
 {
-	double dtx = a->p[x2].t - tx;
-	double dty = b->p[y2].t - ty;
+	double dtx = a->t[x2] - tx;
+	double dty = b->t[y2] - ty;
 	if (dtx >= dty * 2.2 || dty >= dtx * 2.2 || dtx < EPS || dty < EPS)
 		return;
 	(*k)++;
 
+	/* target outside of the corridor: it cannot be on a path to the end */
+	int ix2 = band_index(band, x2, y2);
+	if (ix2 < 0)
+		return;
+
+#ifdef STROKE_SIMD
+	/* rows are computed only once they are needed, so that early
+	 * rejection can still skip most of the work */
+	for (; band->ad_rows < x2; band->ad_rows++) {
+		int r = band->ad_rows;
+		if (band->hi[r] >= band->lo[r])
+			angle_row(a->alpha[r], b->alpha + band->lo[r], band->hi[r] - band->lo[r] + 1, band->ad + band->off[r]);
+	}
+#endif
 	double d = 0.0;
 	int i = x, j = y;
-	double next_tx = (a->p[i+1].t - tx) / dtx;
-	double next_ty = (b->p[j+1].t - ty) / dty;
+	double next_tx = (a->t[i+1] - tx) / dtx;
+	double next_ty = (b->t[j+1] - ty) / dty;
 	double cur_t = 0.0;
 
 	for (;;) {
-		double ad = sqr(angle_difference(a->p[i].alpha, b->p[j].alpha));
+		double ad = angle_cost(a, b, band, i, j);
 		double next_t = next_tx < next_ty ? next_tx : next_ty;
 		bool done = next_t >= 1.0 - EPS;
 		if (done)
@@ -187,81 +559,276 @@ static inline void step(const stroke_t *a,
 			break;
 		cur_t = next_t;
 		if (next_tx < next_ty)
-			next_tx = (a->p[++i+1].t - tx) / dtx;
+			next_tx = (a->t[++i+1] - tx) / dtx;
 		else
-			next_ty = (b->p[++j+1].t - ty) / dty;
+			next_ty = (b->t[++j+1] - ty) / dty;
 	}
-	double new_dist = dist[x*N+y] + d * (dtx + dty);
+	double new_dist = band->dist[band_index(band, x, y)] + d * (dtx + dty);
 	if (new_dist != new_dist) abort();
 
-	if (new_dist >= dist[x2*N+y2])
+	if (new_dist >= band->dist[ix2])
 		return;
 
-	prev_x[x2*N+y2] = x;
-	prev_y[x2*N+y2] = y;
-	dist[x2*N+y2] = new_dist;
+	if (band->prev_x) {
+		band->prev_x[ix2] = x;
+		band->prev_y[ix2] = y;
+	}
+	band->dist[ix2] = new_dist;
+	if (new_dist < band->row_min[x2]) {
+		if (band->row_min[x2] > band->max_cost && new_dist <= band->max_cost)
+			band->alive_rows++;
+		band->row_min[x2] = new_dist;
+	}
+}
+
+struct _stroke_compare_ctx_t {
+	int capacity;
+	int path_capacity;
+	int rows_capacity;
+	double *dist;
+	int *prev_x;
+	int *prev_y;
+	int *rows; /* lo, hi and off arrays of struct dp_band */
+	double *row_min;
+#ifdef STROKE_SIMD
+	double *ad; /* same size as dist */
+#endif
+};
+
+stroke_compare_ctx_t *stroke_compare_ctx_alloc(void) {
+	return calloc(1, sizeof(stroke_compare_ctx_t));
+}
+
+static void ctx_free_arrays(stroke_compare_ctx_t *ctx) {
+#ifdef STROKE_SIMD
+	free(ctx->ad);
+#endif
+	free(ctx->row_min);
+	free(ctx->rows);
+	free(ctx->prev_y);
+	free(ctx->prev_x);
+	free(ctx->dist);
+}
+
+void stroke_compare_ctx_free(stroke_compare_ctx_t *ctx) {
+	if (ctx)
+		ctx_free_arrays(ctx);
+	free(ctx);
+}
+
+/* Make sure that the workspace can hold the row bounds for M rows. */
+static bool ctx_reserve_rows(stroke_compare_ctx_t *ctx, int M) {
+	if (ctx->rows_capacity < M) {
+		int *rows = realloc(ctx->rows, (3 * M + 1) * sizeof(int));
+		if (!rows)
+			return false;
+		ctx->rows = rows;
+		double *row_min = realloc(ctx->row_min, M * sizeof(double));
+		if (!row_min)
+			return false;
+		ctx->row_min = row_min;
+		ctx->rows_capacity = M;
+	}
+	return true;
+}
+
+/* Make sure that the workspace can hold a DP table of size elements
+ * (and the arrays needed to reconstruct the path if with_path is true).
+ * Arrays are only ever grown, so that repeated comparisons do not
+ * need to allocate memory. */
+static bool ctx_reserve(stroke_compare_ctx_t *ctx, int size, bool with_path) {
+	if (ctx->capacity < size) {
+		double *dist = realloc(ctx->dist, size * sizeof(double));
+		if (!dist)
+			return false;
+		ctx->dist = dist;
+#ifdef STROKE_SIMD
+		/* note: previous contents are not needed */
+		free(ctx->ad);
+		ctx->ad = malloc(size * sizeof(double));
+		if (!ctx->ad) {
+			ctx->capacity = 0;
+			return false;
+		}
+#endif
+		ctx->capacity = size;
+	}
+	if (with_path && ctx->path_capacity < size) {
+		/* note: previous contents are not needed, no need to use realloc() */
+		free(ctx->prev_x);
+		free(ctx->prev_y);
+		ctx->prev_x = malloc(size * sizeof(int));
+		ctx->prev_y = malloc(size * sizeof(int));
+		if (!(ctx->prev_x && ctx->prev_y)) {
+			free(ctx->prev_x);
+			free(ctx->prev_y);
+			ctx->prev_x = NULL;
+			ctx->prev_y = NULL;
+			ctx->path_capacity = 0;
+			return false;
+		}
+		ctx->path_capacity = size;
+	}
+	return true;
+}
+
+/* Slack used when computing the corridor, to account for rounding errors
+ * accumulated along a path; this only makes the corridor wider. */
+#define BAND_SLACK 1e-9
+
+/* Compute the corridor of cells that can be part of a path from (0,0) to
+ * (m,n) in stroke_compare(). Every step of such a path has a slope between
+ * 1/2.2 and 2.2, so a cell (x,y) can only be on a path if both (t_a, t_b)
+ * and (1 - t_a, 1 - t_b) satisfy the same constraint. Since t is
+ * nondecreasing along both strokes, each row is an interval whose bounds
+ * are nondecreasing, which we find with a single sweep. Cells outside of
+ * the corridor can still be reached, but their distance can never
+ * contribute to the final result. Returns the number of cells stored. */
+static int compute_band(const stroke_t *a, const stroke_t *b, int *lo, int *hi, int *off) {
+	const int M = a->n;
+	const int N = b->n;
+	const int m = M - 1;
+	const int n = N - 1;
+	if (!(a->t[m] == 1.0 && b->t[n] == 1.0)) {
+		/* degenerate stroke (e.g. zero length or a single point) */
+		for (int x = 0; x < M; x++) {
+			lo[x] = 0;
+			hi[x] = n;
+			off[x] = x * N;
+		}
+		off[M] = M * N;
+		return M * N;
+	}
+
+	int l = 0, h = -1;
+	off[0] = 0;
+	for (int x = 0; x < M; x++) {
+		double ta = a->t[x];
+		double upper = 2.2 * ta + BAND_SLACK;
+		double upper_end = 2.2 * (1.0 - ta) + BAND_SLACK;
+		while (h < n && b->t[h+1] <= upper && 1.0 - ta <= 2.2 * (1.0 - b->t[h+1]) + BAND_SLACK)
+			h++;
+		while (l <= n && !(ta <= 2.2 * b->t[l] + BAND_SLACK && 1.0 - b->t[l] <= upper_end))
+			l++;
+		lo[x] = l;
+		hi[x] = h;
+		off[x+1] = off[x] + (h >= l ? h - l + 1 : 0);
+	}
+	return off[M];
 }
 
 /* To compare two gestures, we use dynamic programming to minimize (an
  * approximation) of the integral over square of the angle difference among
  * (roughly) all reparametrizations whose slope is always between 1/2 and 2.
+ * If the result would be larger than max_cost, we can stop early and
+ * return stroke_infinity instead.
  */
-double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
+static double compare_internal(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b,
+		int *path_x, int *path_y, double max_cost) {
 	const int M = a->n;
 	const int N = b->n;
 	const int m = M - 1;
 	const int n = N - 1;
+	const bool with_path = path_x && path_y;
 
-	double* dist = malloc(M * N * sizeof(double));
-	int* prev_x  = malloc(M * N * sizeof(int));
-	int* prev_y  = malloc(M * N * sizeof(int));
-	for (int i = 0; i < m; i++)
-		for (int j = 0; j < n; j++)
-			dist[i*N+j] = stroke_infinity;
-	dist[M*N-1] = stroke_infinity;
-	dist[0] = 0.0;
+	int size = 0;
+	if (ctx_reserve_rows(ctx, M)) {
+		size = compute_band(a, b, ctx->rows, ctx->rows + M, ctx->rows + 2 * M);
+		if (!ctx_reserve(ctx, size, with_path))
+			size = 0;
+	}
+	if (!size) {
+		if (with_path) {
+			path_x[0] = 0;
+			path_y[0] = 0;
+		}
+		return stroke_infinity;
+	}
+
+	struct dp_band band = {
+		.dist = ctx->dist,
+		/* prev_x and prev_y are only updated if the path is needed */
+		.prev_x = with_path ? ctx->prev_x : NULL,
+		.prev_y = with_path ? ctx->prev_y : NULL,
+		.row_min = ctx->row_min,
+		.alive_rows = (0.0 <= max_cost), /* only row 0 has a cell set */
+		.max_cost = max_cost,
+		.lo = ctx->rows,
+		.hi = ctx->rows + M,
+		.off = ctx->rows + 2 * M,
+#ifdef STROKE_SIMD
+		.ad = ctx->ad,
+		.ad_rows = 0
+#endif
+	};
+	for (int i = 0; i < size; i++)
+		band.dist[i] = stroke_infinity;
+	band.dist[0] = 0.0;
+	for (int x = 0; x < M; x++)
+		band.row_min[x] = stroke_infinity;
+	band.row_min[0] = 0.0;
+	const bool bounded = max_cost < stroke_infinity;
 
 	for (int x = 0; x < m; x++) {
-		for (int y = 0; y < n; y++) {
-			if (dist[x*N+y] >= stroke_infinity)
+		/* Since the cost of each step is nonnegative, the cost of a path
+		 * is at least the distance stored in any cell along it. All cells
+		 * in rows < x were already used as starting points, so if no cell
+		 * in rows x..m has a distance of at most max_cost, no path can
+		 * have a cost of at most max_cost. */
+		if (bounded && !band.alive_rows) {
+			if (with_path) {
+				path_x[0] = 0;
+				path_y[0] = 0;
+			}
+			return stroke_infinity;
+		}
+		const int y_end = band.hi[x] < n ? band.hi[x] : n - 1;
+		for (int y = band.lo[x]; y <= y_end; y++) {
+			double cur = band.dist[band_index(&band, x, y)];
+			if (cur >= stroke_infinity || cur > max_cost)
 				continue;
-			double tx  = a->p[x].t;
-			double ty  = b->p[y].t;
+			double tx  = a->t[x];
+			double ty  = b->t[y];
 			int max_x = x;
 			int max_y = y;
 			int k = 0;
 
 			while (k < 4) {
-				if (a->p[max_x+1].t - tx > b->p[max_y+1].t - ty) {
+				if (a->t[max_x+1] - tx > b->t[max_y+1] - ty) {
 					max_y++;
 					if (max_y == n) {
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, m, n);
+						step(a, b, &band, x, y, tx, ty, &k, m, n);
 						break;
 					}
 					for (int x2 = x+1; x2 <= max_x; x2++)
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, x2, max_y);
+						step(a, b, &band, x, y, tx, ty, &k, x2, max_y);
 				} else {
 					max_x++;
 					if (max_x == m) {
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, m, n);
+						step(a, b, &band, x, y, tx, ty, &k, m, n);
 						break;
 					}
 					for (int y2 = y+1; y2 <= max_y; y2++)
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, max_x, y2);
+						step(a, b, &band, x, y, tx, ty, &k, max_x, y2);
 				}
 			}
 		}
+		/* row x is done, its cells cannot be the start of any more steps */
+		if (band.row_min[x] <= max_cost)
+			band.alive_rows--;
 	}
-	double cost = dist[M*N-1];
-	if (path_x && path_y) {
+	double cost = band.dist[size-1];
+	if (cost > max_cost)
+		cost = stroke_infinity;
+	if (with_path) {
 		if (cost < stroke_infinity) {
 			int x = m;
 			int y = n;
 			int k = 0;
 			while (x || y) {
-				int old_x = x;
-				x = prev_x[x*N+y];
-				y = prev_y[old_x*N+y];
+				int ix = band_index(&band, x, y);
+				x = band.prev_x[ix];
+				y = band.prev_y[ix];
 				path_x[k] = x;
 				path_y[k] = y;
 				k++;
@@ -272,9 +839,100 @@ double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *pa
 		}
 	}
 
-	free(prev_y);
-	free(prev_x);
-	free(dist);
+	return cost;
+}
+
+double stroke_compare_ctx(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
+	return compare_internal(ctx, a, b, path_x, path_y, stroke_infinity);
+}
+
+double stroke_compare_ctx_bounded(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, double max_cost) {
+	return compare_internal(ctx, a, b, NULL, NULL, max_cost);
+}
+
+double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
+	stroke_compare_ctx_t ctx = {0};
+	double cost = stroke_compare_ctx(&ctx, a, b, path_x, path_y);
+	ctx_free_arrays(&ctx);
+	return cost;
+}
 
+double stroke_compare_bounded(const stroke_t *a, const stroke_t *b, double max_cost) {
+	stroke_compare_ctx_t ctx = {0};
+	double cost = stroke_compare_ctx_bounded(&ctx, a, b, max_cost);
+	ctx_free_arrays(&ctx);
 	return cost;
 }
+
+/* true if template i comes after template j when ranked by score */
+static bool ranks_after(const stroke_score_t *s, int i, int j) {
+	return s[i].score < s[j].score || (s[i].score == s[j].score && i > j);
+}
+
+static void rank_sift_down(stroke_score_t *s, int k, int n) {
+	int x = s[k].order;
+	while (2 * k + 1 < n) {
+		int c = 2 * k + 1;
+		if (c + 1 < n && ranks_after(s, s[c+1].order, s[c].order))
+			c++;
+		if (!ranks_after(s, s[c].order, x))
+			break;
+		s[k].order = s[c].order;
+		k = c;
+	}
+	s[k].order = x;
+}
+
+/* Sort the order fields of s by rank. This uses heapsort, so it takes
+ * O(n log n) time without additional memory; it is not stable, but
+ * ranks_after() resolves ties by the index, so this does not matter. */
+static void rank_scores(stroke_score_t *s, int n) {
+	for (int k = n / 2 - 1; k >= 0; k--)
+		rank_sift_down(s, k, n);
+	for (int m = n - 1; m > 0; m--) {
+		int tmp = s[0].order;
+		s[0].order = s[m].order;
+		s[m].order = tmp;
+		rank_sift_down(s, 0, m);
+	}
+}
+
+int stroke_compare_many_ctx(stroke_compare_ctx_t *ctx, const stroke_t *query, const stroke_t *const *templates,
+		int n, stroke_score_t *scores_out, int flags) {
+	double best_score = 0.0;
+	int best = -1;
+	for (int i = 0; i < n; i++) {
+		stroke_score_t *res = scores_out + i;
+		double max_cost = (flags & STROKE_COMPARE_EARLY_REJECT) ? (1.0 - best_score) / 2.5 : stroke_infinity;
+		/* small margin to account for rounding when converting back from the score */
+		if (flags & STROKE_COMPARE_KEEP_TIES)
+			max_cost += 1e-9;
+		res->cost = stroke_infinity;
+		res->score = 0.0;
+		res->order = i;
+		res->compared = !((flags & STROKE_COMPARE_PREFILTER) && stroke_lower_bound(query, templates[i]) > max_cost);
+		if (!res->compared)
+			continue;
+		res->cost = compare_internal(ctx, query, templates[i], NULL, NULL, max_cost);
+		if (res->cost >= stroke_infinity)
+			continue;
+		res->score = 1.0 - 2.5 * res->cost;
+		if (res->score < 0.0)
+			res->score = 0.0;
+		if (res->score > best_score) {
+			best_score = res->score;
+			best = i;
+		}
+	}
+	if (flags & STROKE_COMPARE_RANK)
+		rank_scores(scores_out, n);
+	return best;
+}
+
+int stroke_compare_many(const stroke_t *query, const stroke_t *const *templates, int n,
+		stroke_score_t *scores_out, int flags) {
+	stroke_compare_ctx_t ctx = {0};
+	int best = stroke_compare_many_ctx(&ctx, query, templates, n, scores_out, flags);
+	ctx_free_arrays(&ctx);
+	return best;
+}
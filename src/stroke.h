@@ -17,6 +17,8 @@
 #ifndef __STROKE_H__
 #define __STROKE_H__
 
+#include <stddef.h>
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -26,21 +28,102 @@ struct _stroke_t;
 typedef struct _stroke_t stroke_t;
 
 stroke_t *stroke_alloc(int n);
+/* Remove all points from a stroke (finished or not), so that up to n
+ * points can be added again, followed by stroke_finish(). The existing
+ * memory is reused if it is large enough. Returns 0 if memory could not
+ * be allocated (the stroke is unchanged in this case). */
+int stroke_reset(stroke_t *stroke, int n);
 void stroke_add_point(stroke_t *stroke, double x, double y);
 void stroke_finish(stroke_t *stroke);
 void stroke_free(stroke_t *stroke);
 stroke_t *stroke_copy(const stroke_t *stroke);
 
+/* A finished stroke can be stored as a flat array of stroke_data_size(n)
+ * doubles (e.g. in a file), including its signature and the values
+ * computed by stroke_finish(). stroke_from_data() creates a stroke that
+ * uses such an array directly without copying it: the array must be
+ * aligned for doubles and stay valid and unchanged while the stroke
+ * exists (it is not freed by stroke_free(); stroke_reset() allocates new
+ * memory for the stroke). The data is only valid on the same architecture. */
+size_t stroke_data_size(int n);
+void stroke_get_data(const stroke_t *stroke, double *data);
+stroke_t *stroke_from_data(int n, const double *data);
+
 int stroke_get_size(const stroke_t *stroke);
 void stroke_get_point(const stroke_t *stroke, int n, double *x, double *y);
 double stroke_get_time(const stroke_t *stroke, int n);
 double stroke_get_angle(const stroke_t *stroke, int n);
 double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int j);
 
+/* A signature of each stroke is computed by stroke_finish(). It can be
+ * used to get a lower bound for the result of stroke_compare() without
+ * running it (the bound is the same for both orders of a and b). */
+double stroke_lower_bound(const stroke_t *a, const stroke_t *b);
+/* Approximate dissimilarity of two strokes, based on the directions at
+ * the start and end, the total turning angle and the aspect ratio. The
+ * result is between 0 and 1; this is not a bound on the actual cost. */
+double stroke_signature_distance(const stroke_t *a, const stroke_t *b);
+
 double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y);
+/* Same as stroke_compare(), but only calculates the exact cost if it is
+ * at most max_cost; otherwise, stroke_infinity is returned. This allows
+ * stopping early once no partial match can be extended to one with a
+ * cost of at most max_cost. */
+double stroke_compare_bounded(const stroke_t *a, const stroke_t *b, double max_cost);
+
+/* Reusable workspace for stroke_compare_ctx(). It grows to fit the
+ * largest pair of strokes compared so far, so that repeated comparisons
+ * do not need to allocate memory. A workspace must not be used from
+ * multiple threads at the same time. */
+struct _stroke_compare_ctx_t;
+typedef struct _stroke_compare_ctx_t stroke_compare_ctx_t;
+
+stroke_compare_ctx_t *stroke_compare_ctx_alloc(void);
+void stroke_compare_ctx_free(stroke_compare_ctx_t *ctx);
+/* Same as stroke_compare(), but using the given workspace. If path_x
+ * or path_y is NULL, the path is not tracked at all. */
+double stroke_compare_ctx(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y);
+double stroke_compare_ctx_bounded(stroke_compare_ctx_t *ctx, const stroke_t *a, const stroke_t *b, double max_cost);
+
+/* Result of comparing a query to one template in stroke_compare_many(). */
+typedef struct {
+	double cost;  /* matching cost, stroke_infinity if no match or rejected */
+	double score; /* similarity between 0 and 1 (1 - 2.5 * cost) */
+	int compared; /* 0 if the template was skipped based on its signature */
+	int order;    /* with STROKE_COMPARE_RANK, index of the template at this rank */
+} stroke_score_t;
+
+/* Flags for stroke_compare_many() */
+/* reject templates that cannot score higher than the best one before them */
+#define STROKE_COMPARE_EARLY_REJECT 1
+/* also skip such templates based on stroke_lower_bound() */
+#define STROKE_COMPARE_PREFILTER 2
+/* fill in the order field (by decreasing score, ties by index) */
+#define STROKE_COMPARE_RANK 4
+/* with STROKE_COMPARE_EARLY_REJECT, still compare templates that can
+ * have the same score as the best one before them (so that the caller
+ * can resolve ties differently, e.g. if templates are not in order) */
+#define STROKE_COMPARE_KEEP_TIES 8
+
+/* Compare query to n templates. Results are stored in scores_out (which
+ * needs space for n elements). Returns the index of the template with the
+ * highest score (the first one if several have the same score), or -1 if
+ * no template has a score above zero. */
+int stroke_compare_many(const stroke_t *query, const stroke_t *const *templates, int n,
+	stroke_score_t *scores_out, int flags);
+int stroke_compare_many_ctx(stroke_compare_ctx_t *ctx, const stroke_t *query, const stroke_t *const *templates,
+	int n, stroke_score_t *scores_out, int flags);
 
 extern const double stroke_infinity;
 
+#ifdef STROKE_SIMD
+/* Select the kernel used to compute angle differences in stroke_compare()
+ * (0: scalar, 1: SSE2, 2: AVX2) instead of the one chosen for the CPU.
+ * Returns 0 if it is not supported. This is only meant for tests and
+ * benchmarks; it should not be called while strokes are compared. */
+int stroke_set_kernel(int kernel);
+#endif
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __STROKE_MATCH_H__
+#define __STROKE_MATCH_H__
+
+#include "stroke.h"
+#include <array>
+#include <vector>
+#include <cmath>
+#include <type_traits>
+#include <cstdint>
+#include <algorithm>
+
+/* Encodings of the parameter (t) and angle (alpha) of stroke points. */
+
+/* Store values as they are, using type T. */
+template<class T>
+struct PlainEncoding {
+	using t_type = T;
+	using alpha_type = T;
+	static t_type encode_t(double t) { return T(t); }
+	static alpha_type encode_alpha(double alpha) { return T(alpha); }
+	static T get_t(t_type t) { return t; }
+	/* difference of two angles, wrapped to [-1, 1] */
+	static T angle_difference(alpha_type alpha, alpha_type beta) {
+		T d = alpha - beta;
+		if(d < T(-1)) d += T(2);
+		else if(d > T(1)) d -= T(2);
+		return d;
+	}
+};
+
+/* Store t as a 16-bit unsigned fixed-point number and alpha as a 16-bit
+ * signed one, so that a full turn corresponds to 2^16 units; the
+ * difference of two angles then wraps around without extra work. */
+template<class T>
+struct QuantizedEncoding {
+	using t_type = uint16_t;
+	using alpha_type = int16_t;
+	static t_type encode_t(double t) {
+		return (t_type)std::lround(std::min(std::max(t, 0.0), 1.0) * 65535.0);
+	}
+	static alpha_type encode_alpha(double alpha) {
+		long a = std::lround(alpha * 32768.0);
+		return (alpha_type)(uint16_t)(a & 0xffff);
+	}
+	static T get_t(t_type t) { return T(t) * T(1.0 / 65535.0); }
+	static T angle_difference(alpha_type alpha, alpha_type beta) {
+		return T((int16_t)(uint16_t)(alpha - beta)) * T(1.0 / 32768.0);
+	}
+};
+
+/* Resample a finished stroke to N points that are equally spaced along
+ * its length (the stroke must have at least two points and t[n-1] == 1). */
+template<class T, int N>
+static void resample_stroke(const stroke_t* s, std::array<T, N>& x, std::array<T, N>& y) {
+	static_assert(N >= 2, "resample_stroke: need at least two points");
+	int n = stroke_get_size(s);
+	int j = 0;
+	for(int i = 0; i < N; i++) {
+		/* t is the normalized arc length */
+		double t = (double)i / (N - 1);
+		while(j < n - 2 && stroke_get_time(s, j + 1) < t) j++;
+		double t1 = stroke_get_time(s, j), t2 = stroke_get_time(s, j + 1);
+		double x1, y1, x2, y2;
+		stroke_get_point(s, j, &x1, &y1);
+		stroke_get_point(s, j + 1, &x2, &y2);
+		double r = (t2 > t1) ? (t - t1) / (t2 - t1) : 0.0;
+		if(r < 0.0) r = 0.0;
+		if(r > 1.0) r = 1.0;
+		x[i] = x1 + r * (x2 - x1);
+		y[i] = y1 + r * (y2 - y1);
+	}
+}
+
+/* Templated version of the matching algorithm in stroke.c.
+ *
+ * T is the scalar type used for the computation (float or double). If
+ * N > 0, strokes are resampled to exactly N points that are equally spaced
+ * along their length, and all arrays, including the table used for the
+ * dynamic programming, have a size known at compile time and are allocated
+ * on the stack. With N == 0, the points of the strokes are used as they are;
+ * StrokeMatcher<double, 0> gives the same result as stroke_compare().
+ * E determines how points are stored (see above); the computation is
+ * done using T in all cases.
+ */
+template<class T, int N = 0, class E = PlainEncoding<T>>
+class StrokeMatcher {
+	public:
+		template<class S>
+		using array_t = typename std::conditional<(N > 0), std::array<S, N>, std::vector<S>>::type;
+
+		/* Stroke data used by the matcher. */
+		struct Prepared {
+			array_t<typename E::t_type> t;
+			array_t<typename E::alpha_type> alpha;
+			int size() const { return (int)t.size(); }
+		};
+
+		/* Convert a finished stroke into the representation used here.
+		 * Returns false for strokes that cannot be matched (these have
+		 * fewer than two points or a zero length). */
+		static bool prepare(const stroke_t* s, Prepared& out) {
+			int n = s ? stroke_get_size(s) : 0;
+			if(n < 2 || stroke_get_time(s, n - 1) != 1.0) return false;
+			if constexpr (N > 0) {
+				std::array<T, N> x, y;
+				resample_stroke<T, N>(s, x, y);
+				for(int i = 0; i < N; i++)
+					out.t[i] = E::encode_t((double)i / (N - 1));
+				for(int i = 0; i + 1 < N; i++)
+					out.alpha[i] = E::encode_alpha(std::atan2(y[i+1] - y[i], x[i+1] - x[i]) / M_PI);
+				out.alpha[N - 1] = E::encode_alpha(0.0);
+			}
+			else {
+				out.t.resize(n);
+				out.alpha.resize(n);
+				for(int i = 0; i < n; i++) {
+					out.t[i] = E::encode_t(stroke_get_time(s, i));
+					out.alpha[i] = E::encode_alpha((i + 1 < n) ? stroke_get_angle(s, i) : 0.0);
+				}
+			}
+			return true;
+		}
+
+		/* Compare two prepared strokes; returns the matching cost, or
+		 * stroke_infinity if it is larger than max_cost (see
+		 * stroke_compare_bounded()). */
+		static T compare(const Prepared& a, const Prepared& b, T max_cost = T(stroke_infinity)) {
+			if constexpr (N > 0) {
+				std::array<T, N * N> dist;
+				std::array<T, N> row_min;
+				return compare_internal(a, b, N, N, dist.data(), row_min.data(), max_cost);
+			}
+			else {
+				/* reuse the same arrays for all comparisons on one thread */
+				static thread_local std::vector<T> dist, row_min;
+				if(dist.size() < (size_t)a.size() * b.size()) dist.resize((size_t)a.size() * b.size());
+				if(row_min.size() < (size_t)a.size()) row_min.resize(a.size());
+				return compare_internal(a, b, a.size(), b.size(), dist.data(), row_min.data(), max_cost);
+			}
+		}
+
+	private:
+		static constexpr T eps = T(0.000001);
+		static constexpr T sqr(T x) { return x * x; }
+
+		/* Note: if N > 0, the number of points is always N, and the
+		 * compiler can use this to optimize the loops below. */
+		static constexpr int size(int n) { if constexpr (N > 0) return N; else return n; }
+
+		/* alive_rows: number of rows not processed yet with a row_min of at
+		 * most max_cost (see compare_internal()) */
+		static inline void step(const Prepared& a, const Prepared& b, int N2, T* dist, T* row_min,
+				T max_cost, int& alive_rows, int x, int y, T tx, T ty, int& k, int x2, int y2) {
+			T dtx = E::get_t(a.t[x2]) - tx;
+			T dty = E::get_t(b.t[y2]) - ty;
+			if(dtx >= dty * T(2.2) || dty >= dtx * T(2.2) || dtx < eps || dty < eps)
+				return;
+			k++;
+
+			T d = T(0);
+			int i = x, j = y;
+			T next_tx = (E::get_t(a.t[i+1]) - tx) / dtx;
+			T next_ty = (E::get_t(b.t[j+1]) - ty) / dty;
+			T cur_t = T(0);
+
+			for(;;) {
+				T ad = sqr(E::angle_difference(a.alpha[i], b.alpha[j]));
+				T next_t = next_tx < next_ty ? next_tx : next_ty;
+				bool done = next_t >= T(1) - eps;
+				if(done) next_t = T(1);
+				d += (next_t - cur_t) * ad;
+				if(done) break;
+				cur_t = next_t;
+				if(next_tx < next_ty) next_tx = (E::get_t(a.t[++i+1]) - tx) / dtx;
+				else next_ty = (E::get_t(b.t[++j+1]) - ty) / dty;
+			}
+			T new_dist = dist[x*N2+y] + d * (dtx + dty);
+			if(new_dist >= dist[x2*N2+y2]) return;
+			dist[x2*N2+y2] = new_dist;
+			if(new_dist < row_min[x2]) {
+				if(row_min[x2] > max_cost && new_dist <= max_cost) alive_rows++;
+				row_min[x2] = new_dist;
+			}
+		}
+
+		static T compare_internal(const Prepared& a, const Prepared& b, int M1, int N1,
+				T* dist, T* row_min, T max_cost) {
+			const T infinity = T(stroke_infinity);
+			const int M2 = size(M1);
+			const int N2 = size(N1);
+			const int m = M2 - 1;
+			const int n = N2 - 1;
+			for(int i = 0; i < M2 * N2; i++) dist[i] = infinity;
+			for(int i = 0; i < M2; i++) row_min[i] = infinity;
+			dist[0] = T(0);
+			row_min[0] = T(0);
+			int alive_rows = (T(0) <= max_cost); /* only row 0 has a cell set */
+
+			for(int x = 0; x < m; x++) {
+				/* early rejection, as in compare_internal() in stroke.c: all
+				 * paths continue from a cell in rows x..m, so if none of
+				 * these is at most max_cost, the result is larger as well */
+				if(max_cost < infinity && !alive_rows) return infinity;
+				for(int y = 0; y < n; y++) {
+					T cur = dist[x*N2+y];
+					if(cur >= infinity || cur > max_cost) continue;
+					T tx = E::get_t(a.t[x]);
+					T ty = E::get_t(b.t[y]);
+					int max_x = x;
+					int max_y = y;
+					int k = 0;
+
+					while(k < 4) {
+						if(E::get_t(a.t[max_x+1]) - tx > E::get_t(b.t[max_y+1]) - ty) {
+							max_y++;
+							if(max_y == n) {
+								step(a, b, N2, dist, row_min, max_cost, alive_rows, x, y, tx, ty, k, m, n);
+								break;
+							}
+							for(int x2 = x+1; x2 <= max_x; x2++)
+								step(a, b, N2, dist, row_min, max_cost, alive_rows, x, y, tx, ty, k, x2, max_y);
+						}
+						else {
+							max_x++;
+							if(max_x == m) {
+								step(a, b, N2, dist, row_min, max_cost, alive_rows, x, y, tx, ty, k, m, n);
+								break;
+							}
+							for(int y2 = y+1; y2 <= max_y; y2++)
+								step(a, b, N2, dist, row_min, max_cost, alive_rows, x, y, tx, ty, k, max_x, y2);
+						}
+					}
+				}
+				/* row x is done, its cells cannot be the start of any more steps */
+				if(row_min[x] <= max_cost) alive_rows--;
+			}
+			T cost = dist[M2*N2-1];
+			return (cost > max_cost) ? infinity : cost;
+		}
+};
+
+/* Protractor-style matcher (Y. Li, "Protractor: a fast and accurate
+ * gesture recognizer", CHI 2010), without rotation invariance: strokes
+ * are resampled to N points, translated to their centroid and scaled to
+ * unit length as a vector of 2N coordinates. Their similarity is the
+ * cosine of the angle between these vectors, so comparing two strokes
+ * takes O(N) time. The cost returned by compare() is scaled to be
+ * comparable with stroke_compare(): it is cost_scale * angle / pi. */
+template<class T, int N>
+class ProtractorMatcher {
+	public:
+		struct Prepared {
+			std::array<T, 2 * N> v;
+		};
+
+		static constexpr double cost_scale = 0.8;
+
+		static bool prepare(const stroke_t* s, Prepared& out) {
+			int n = s ? stroke_get_size(s) : 0;
+			if(n < 2 || stroke_get_time(s, n - 1) != 1.0) return false;
+			std::array<T, N> x, y;
+			resample_stroke<T, N>(s, x, y);
+			T cx = T(0), cy = T(0);
+			for(int i = 0; i < N; i++) {
+				cx += x[i];
+				cy += y[i];
+			}
+			cx /= N;
+			cy /= N;
+			T len = T(0);
+			for(int i = 0; i < N; i++) {
+				out.v[2*i] = x[i] - cx;
+				out.v[2*i+1] = y[i] - cy;
+				len += out.v[2*i] * out.v[2*i] + out.v[2*i+1] * out.v[2*i+1];
+			}
+			if(!(len > T(0))) return false;
+			len = std::sqrt(len);
+			for(auto& z : out.v) z /= len;
+			return true;
+		}
+
+		/* Returns the matching cost, or stroke_infinity if it is larger than max_cost. */
+		static T compare(const Prepared& a, const Prepared& b, T max_cost = T(stroke_infinity)) {
+			T dot = T(0);
+			for(int i = 0; i < 2 * N; i++) dot += a.v[i] * b.v[i];
+			dot = std::min(std::max(dot, T(-1)), T(1));
+			T cost = T(cost_scale) * std::acos(dot) / T(M_PI);
+			return (cost > max_cost || cost >= T(stroke_infinity)) ? T(stroke_infinity) : cost;
+		}
+};
+
+#endif
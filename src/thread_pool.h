@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+/* Simple pool of worker threads that can run a number of tasks in
+ * parallel. Only one run() call can be active at a time (it should be
+ * called from the same thread that created the pool). */
+class ThreadPool {
+	public:
+		/* Create a pool that runs tasks on n_threads threads in total,
+		 * including the one calling run() (so n_threads - 1 workers). */
+		explicit ThreadPool(unsigned int n_threads) {
+			for(unsigned int i = 1; i < n_threads; i++)
+				workers.emplace_back([this]() { worker(); });
+		}
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			cv_start.notify_all();
+			for(auto& t : workers) t.join();
+		}
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator = (const ThreadPool&) = delete;
+
+		unsigned int size() const { return workers.size() + 1; }
+
+		/* Call task(i) for i = 0, ..., n_tasks - 1 and wait until all
+		 * calls are finished. Tasks are run in an unspecified order. */
+		void run(unsigned int n_tasks, const std::function<void(unsigned int)>& task) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				current = &task;
+				total = n_tasks;
+				next = 0;
+				done = 0;
+			}
+			cv_start.notify_all();
+			/* also take part in running the tasks */
+			std::unique_lock<std::mutex> lock(mutex);
+			run_tasks(lock);
+			cv_done.wait(lock, [this]() { return done == total; });
+			current = nullptr;
+		}
+
+	private:
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable cv_start;
+		std::condition_variable cv_done;
+		const std::function<void(unsigned int)>* current = nullptr;
+		unsigned int total = 0;
+		unsigned int next = 0;
+		unsigned int done = 0;
+		bool stop = false;
+
+		/* run tasks until there are none left; lock must be held */
+		void run_tasks(std::unique_lock<std::mutex>& lock) {
+			while(current && next < total) {
+				unsigned int i = next++;
+				const auto* task = current;
+				lock.unlock();
+				(*task)(i);
+				lock.lock();
+				if(++done == total) cv_done.notify_all();
+			}
+		}
+
+		void worker() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true) {
+				cv_start.wait(lock, [this]() { return stop || (current && next < total); });
+				if(stop) return;
+				run_tasks(lock);
+			}
+		}
+};
+
+#endif
+
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Recognizing a gesture in the plugin should not allocate memory once the
+ * buffers used for this have grown large enough. This goes through the
+ * same steps as the plugin: collecting points with a PreStrokeSampler,
+ * assigning them to a reused Stroke, then matching it with handle() or
+ * with an IncrementalMatcher (with each engine, and keeping the best
+ * matches in the Ranking for every second gesture), and counting the usage.
+ * The same gestures are recognized twice: the first time, buffers can
+ * grow as needed, while the second time, nothing should be allocated.
+ * Usage: alloc_test actions_file */
+
+#include "gesture.h"
+#include "actiondb.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+static bool counting = false;
+static long n_alloc = 0;
+
+#ifdef __GLIBC__
+/* count all allocations, also the ones done in stroke.c */
+extern "C" {
+	void* __libc_malloc(size_t n);
+	void* __libc_calloc(size_t n, size_t size);
+	void* __libc_realloc(void* p, size_t n);
+	void* malloc(size_t n) {
+		if(counting) n_alloc++;
+		return __libc_malloc(n);
+	}
+	void* calloc(size_t n, size_t size) {
+		if(counting) n_alloc++;
+		return __libc_calloc(n, size);
+	}
+	void* realloc(void* p, size_t n) {
+		if(counting) n_alloc++;
+		return __libc_realloc(p, n);
+	}
+}
+#else
+void* operator new(size_t n) {
+	if(counting) n_alloc++;
+	void* p = std::malloc(n ? n : 1);
+	if(!p) throw std::bad_alloc();
+	return p;
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#endif
+
+static const int n_gestures = 200;
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s actions_file\n", argv[0]);
+		return 1;
+	}
+	ActionDB actions;
+	if(!actions.read(argv[1], true)) {
+		fprintf(stderr, "Cannot read %s\n", argv[1]);
+		return 1;
+	}
+	actions.build_match_tables();
+	const ActionListDiff<false>* root = actions.get_root();
+	std::vector<std::pair<stroke_id, const Stroke*>> templates;
+	UsageStats usage;
+	for(const auto& x : root->get_strokes()) if(!x.second->trivial()) {
+		templates.emplace_back(x.first, x.second);
+		usage.record(x.first);
+	}
+	if(templates.empty()) {
+		fprintf(stderr, "No gestures in %s\n", argv[1]);
+		return 1;
+	}
+
+	/* gestures are drawn as noisy versions of the templates, scaled to
+	 * screen coordinates and with a varying number of points */
+	std::mt19937 gen(1);
+	std::normal_distribution<double> noise(0.0, 0.005);
+	std::vector<Stroke::PreStroke> gestures(n_gestures);
+	for(auto& g : gestures) {
+		const Stroke& s = *templates[gen() % templates.size()].second;
+		unsigned int n = s.size();
+		unsigned int steps = 4 + gen() % 16;
+		for(unsigned int i = 0; i + 1 < n; i++) {
+			Stroke::Point a = s.points(i), b = s.points(i + 1);
+			for(unsigned int j = 0; j < steps; j++) {
+				double r = (double)j / steps;
+				g.push_back(Stroke::Point{500.0 * (a.x + r * (b.x - a.x) + noise(gen)), 500.0 * (a.y + r * (b.y - a.y) + noise(gen))});
+			}
+		}
+		Stroke::Point last = s.points(n - 1);
+		g.push_back(Stroke::Point{500.0 * last.x, 500.0 * last.y});
+	}
+
+	int errors = 0;
+	const Stroke::Engine engines[] = { Stroke::Engine::Exact, Stroke::Engine::Fast,
+		Stroke::Engine::Quantized, Stroke::Engine::Protractor };
+	const char* engine_names[] = { "exact", "fast", "quantized", "protractor" };
+	for(int e = 0; e < 4; e++) for(int incremental = 0; incremental < 2; incremental++) {
+		/* these are kept between gestures, as in the plugin */
+		PreStrokeSampler ps(256);
+		Stroke stroke;
+		IncrementalMatcher matcher;
+		MatchOptions opts;
+		opts.engine = engines[e];
+		opts.usage = &usage;
+		n_alloc = 0;
+		for(int k = 0; k < 2 * n_gestures; k++) {
+			ps.clear();
+			for(const auto& p : gestures[k % n_gestures]) ps.add(p);
+			counting = (k >= n_gestures);
+			Ranking rr;
+			if(k % 2) rr.top_k = Ranking::max_top_k;
+			Action* action;
+			if(incremental) {
+				matcher.start(root, opts);
+				matcher.update(ps.points(), 1000000);
+				action = matcher.finish(ps.points(), &rr);
+				matcher.reset();
+			}
+			else {
+				stroke.assign(ps.points());
+				action = root->handle(stroke, &rr, opts);
+			}
+			if(action) usage.record(rr.id);
+			counting = false;
+			/* the best matches should be in order, starting with rr.id */
+			if(rr.size() > rr.top_k || (rr.size() && rr.begin()->id != rr.id)) errors++;
+			for(const Ranking::Match* m = rr.begin(); m + 1 < rr.end(); m++)
+				if(m->score < (m + 1)->score || (m->score == (m + 1)->score && m->id > (m + 1)->id)) errors++;
+		}
+		printf("%s%s: %ld allocations in %d gestures\n", engine_names[e], incremental ? " (incremental)" : "",
+			n_alloc, n_gestures);
+		if(n_alloc) errors++;
+	}
+	return errors ? 1 : 0;
+}
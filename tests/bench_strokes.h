@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __BENCH_STROKES_H__
+#define __BENCH_STROKES_H__
+
+/* Generated gestures used by the matching benchmarks, so that they all
+ * run on the same data and do not need a large configuration file. The
+ * templates are random strokes (see random_points()), and each query is
+ * a noisy copy of one of them, so the best match is usually known, but
+ * many other templates still score high enough to be compared fully. */
+
+#include "gesture.h"
+#include "reference.h"
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+struct BenchStrokes {
+	static constexpr int min_points = 8;
+	static constexpr int max_points = 64;
+	std::vector<Stroke> templates;
+	std::vector<Stroke> queries;
+	std::vector<size_t> query_template; /* which template each query was made from */
+
+	BenchStrokes(unsigned int n_templates, unsigned int n_queries, unsigned int seed = 1) {
+		double x[max_points], y[max_points];
+		for(unsigned int i = 0; i < n_templates; i++) {
+			int n = min_points + rand_r(&seed) % (max_points - min_points + 1);
+			random_points(&seed, n, x, y);
+			Stroke::PreStroke ps;
+			for(int j = 0; j < n; j++) ps.push_back(Stroke::Point{x[j], y[j]});
+			templates.emplace_back(ps);
+		}
+		std::mt19937 gen(seed);
+		std::normal_distribution<double> noise(0.0, 1.0);
+		for(unsigned int i = 0; i < n_queries && n_templates; i++) {
+			size_t k = gen() % n_templates;
+			const Stroke& s = templates[k];
+			Stroke::PreStroke ps;
+			for(unsigned int j = 0; j < s.size(); j++) {
+				Stroke::Point p = s.points(j);
+				ps.push_back(Stroke::Point{p.x + 0.02 * noise(gen), p.y + 0.02 * noise(gen)});
+			}
+			queries.emplace_back(ps);
+			query_template.push_back(k);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Recall and speedup of coarse-to-fine matching (MatchOptions::coarse_top_k
+ * and coarse_margin) for the strokes from bench_strokes.h (the same ones as
+ * used by engine_bench). The templates are added to an ActionDB, and each
+ * query is matched with ActionListDiff::handle(), first without the coarse
+ * stage, then with several values of coarse_top_k and coarse_margin. Recall
+ * is the fraction of queries for which the best match is the same as
+ * without the coarse stage.
+ * Usage: coarse_bench [templates] [queries] [repeat]
+ * (default: 500 templates, 100 queries, 3 repeats)
+ * Everything is done repeat times and the fastest time is reported. */
+
+#include "bench_strokes.h"
+#include "actiondb.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+	unsigned int n_templates = (argc > 1) ? atoi(argv[1]) : 500;
+	unsigned int n_queries = (argc > 2) ? atoi(argv[2]) : 100;
+	int repeat = (argc > 3) ? atoi(argv[3]) : 3;
+	BenchStrokes data(n_templates, n_queries);
+	ActionDB actions;
+	for(size_t i = 0; i < data.templates.size(); i++) {
+		StrokeInfo info;
+		info.stroke = data.templates[i].clone();
+		info.name = "template " + std::to_string(i);
+		actions.add_stroke(actions.get_root(), std::move(info));
+	}
+	actions.build_match_tables();
+	const ActionListDiff<false>* root = actions.get_root();
+
+	/* matches all queries with opts; returns the fastest time */
+	std::vector<stroke_id> ids(data.queries.size());
+	double n_compared = 0.0;
+	auto run = [&] (const MatchOptions& opts) {
+		double best = -1.0;
+		for(int r = 0; r <= repeat; r++) {
+			/* the first round prepares the strokes and is not timed */
+			n_compared = 0.0;
+			auto start = std::chrono::steady_clock::now();
+			for(size_t i = 0; i < data.queries.size(); i++) {
+				Ranking rr;
+				root->handle(data.queries[i], &rr, opts);
+				ids[i] = rr.id;
+				n_compared += rr.n_compared;
+			}
+			double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if(r && (best < 0.0 || t < best)) best = t;
+		}
+		return best;
+	};
+
+	MatchOptions opts;
+	double exact_time = run(opts);
+	std::vector<stroke_id> exact_ids = ids;
+	printf("%zu templates, %zu queries\n", data.templates.size(), data.queries.size());
+	printf("without coarse matching: %.3f ms, %.1f templates compared per query\n", exact_time,
+		n_compared / data.queries.size());
+	for(double margin : {0.0, 0.1}) for(unsigned int k : {1, 2, 4, 8, 16, 32}) {
+		opts.coarse_top_k = k;
+		opts.coarse_margin = margin;
+		double t = run(opts);
+		unsigned int same = 0;
+		for(size_t i = 0; i < ids.size(); i++) if(ids[i] == exact_ids[i]) same++;
+		printf("coarse_top_k = %2u, coarse_margin = %.1f: %.3f ms (%.2fx), recall: %.3f, "
+			"%.1f templates compared per query\n", k, margin, t, exact_time / t,
+			ids.empty() ? 1.0 : (double)same / ids.size(), n_compared / data.queries.size());
+	}
+	return 0;
+}
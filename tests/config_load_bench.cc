@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Time loading a configuration file in the same way as the plugin does
+ * (ActionDB::read() and build_match_tables()), and separately, the part
+ * of this spent in stroke_finish() (called for every stroke in it).
+ * Usage: config_load_bench file [repeat]
+ * Use a large configuration for meaningful results; everything is done
+ * repeat times (default: 20) and the fastest time is reported. */
+
+#include "actiondb.h"
+#include "stroke.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s file [repeat]\n", argv[0]);
+		return 1;
+	}
+	int repeat = (argc > 2) ? atoi(argv[2]) : 20;
+	double best = -1.0;
+	size_t n_strokes = 0;
+	std::vector<Stroke::PreStroke> points;
+	for(int i = 0; i < repeat; i++) {
+		auto start = std::chrono::steady_clock::now();
+		ActionDB actions;
+		if(!actions.read(argv[1], true)) {
+			fprintf(stderr, "Cannot read %s\n", argv[1]);
+			return 1;
+		}
+		actions.build_match_tables();
+		double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if(best < 0.0 || t < best) best = t;
+		if(points.empty()) for(const auto& x : actions.get_root()->get_stroke_infos()) {
+			const Stroke& s = x.second->stroke;
+			points.emplace_back();
+			for(unsigned int j = 0; j < s.size(); j++) points.back().push_back(s.points(j));
+		}
+		n_strokes = points.size();
+	}
+	
+	double best_finish = -1.0;
+	size_t n_points = 0;
+	for(int i = 0; i < repeat; i++) {
+		n_points = 0;
+		auto start = std::chrono::steady_clock::now();
+		for(const auto& ps : points) {
+			if(ps.size() < 2) continue;
+			stroke_t* s = stroke_alloc(ps.size());
+			for(const auto& p : ps) stroke_add_point(s, p.x, p.y);
+			stroke_finish(s);
+			stroke_free(s);
+			n_points += ps.size();
+		}
+		double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if(best_finish < 0.0 || t < best_finish) best_finish = t;
+	}
+	printf("%s: %zu gestures in the root, loaded in %.3f ms\n", argv[1], n_strokes, best);
+	printf("stroke_finish() for these (%zu points): %.3f ms\n", n_points, best_finish);
+	return 0;
+}
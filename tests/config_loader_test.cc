@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* ConfigLoader is used by the plugin to load the configuration and save
+ * the usage counts on a separate thread. This uses it in the same way,
+ * with the main thread waiting for its eventfd with poll() instead of
+ * the compositor's event loop, and checks that:
+ *  - every request to load is followed by a load that starts after it,
+ *    and the last one that finishes is taken by the main thread (only
+ *    after its fd becomes readable);
+ *  - the last usage counts given to it are saved (by it, or returned
+ *    from stop() so that they can be saved directly);
+ *  - the error of every load that failed is passed to the main thread;
+ *  - stop() works while it is loading, and a configuration that was not
+ *    taken is freed (run with -fsanitize=address or thread to check this
+ *    and the synchronization). */
+
+#include "config_loader.h"
+#include <poll.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+
+static const int n_rounds = 2000;
+
+/* which request each loaded version corresponds to */
+static std::mutex loaded_mutex;
+static std::map<const ActionDB*, unsigned int> loaded_ids;
+
+int main() {
+	int errors = 0;
+	std::mt19937 gen(1);
+	std::atomic<unsigned int> n_loads{0};
+	std::atomic<unsigned int> n_failed{0};
+	std::atomic<bool> slow{false};
+	UsageStats saved; /* last counts saved (only used by the loader thread until it is stopped) */
+	ConfigLoader loader([&] (unsigned int id, std::string& error) -> ActionDB* {
+			n_loads++;
+			if(slow) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			if(id % 7 == 0) {
+				/* could not be loaded */
+				n_failed++;
+				error = std::to_string(id);
+				return nullptr;
+			}
+			ActionDB* a = new ActionDB();
+			std::lock_guard<std::mutex> lock(loaded_mutex);
+			loaded_ids[a] = id;
+			return a;
+		},
+		[&] (const UsageStats& u, std::string&) {
+			saved = u;
+		});
+	/* errors taken by the main thread, checked to be for failed loads */
+	unsigned int n_errors = 0;
+	auto take_errors = [&] () {
+		for(const std::string& e : loader.take_errors()) {
+			n_errors++;
+			if(atoi(e.c_str()) % 7) {
+				fprintf(stderr, "unexpected error: %s\n", e.c_str());
+				errors++;
+			}
+		}
+	};
+
+	/* without starting the thread, nothing is done */
+	if(loader.running() || loader.take_loaded()) {
+		fprintf(stderr, "loader running before start()\n");
+		errors++;
+	}
+	if(!loader.start()) {
+		fprintf(stderr, "cannot start the loader thread\n");
+		return 1;
+	}
+
+	/* requests are made in bursts (that can be merged), with the main
+	 * thread taking new versions as they become available */
+	unsigned int id = 1;
+	unsigned int last_taken = 0;
+	unsigned int n_taken = 0;
+	stroke_id last_saved = 0;
+	std::shared_ptr<const ActionDB> actions;
+	for(int k = 0; k < n_rounds; k++) {
+		slow = (k % 10 == 0);
+		unsigned int burst = 1 + gen() % 3;
+		for(unsigned int i = 0; i < burst; i++) loader.request_load(id++);
+		if(gen() % 2) {
+			/* each version has a different gesture recorded */
+			last_saved = k + 1;
+			auto u = std::make_unique<UsageStats>();
+			u->record(last_saved);
+			loader.request_save(std::move(u));
+		}
+		unsigned int expected = id - 1;
+		if(expected % 7 == 0) continue; /* this one will not be loaded */
+		/* wait until the last request is loaded */
+		while(last_taken != expected) {
+			struct pollfd p = { loader.fd(), POLLIN, 0 };
+			if(poll(&p, 1, 5000) != 1) {
+				fprintf(stderr, "round %d: no notification for request %u\n", k, expected);
+				return 1;
+			}
+			std::unique_ptr<ActionDB> tmp = loader.take_loaded();
+			take_errors();
+			if(!tmp) continue; /* already taken after an earlier notification, or only an error */
+			unsigned int taken;
+			{
+				std::lock_guard<std::mutex> lock(loaded_mutex);
+				auto it = loaded_ids.find(tmp.get());
+				taken = (it == loaded_ids.end()) ? 0 : it->second;
+				if(it != loaded_ids.end()) loaded_ids.erase(it);
+			}
+			if(taken <= last_taken || taken > expected) {
+				fprintf(stderr, "round %d: took version %u after %u (last request: %u)\n", k, taken, last_taken, expected);
+				errors++;
+			}
+			last_taken = taken;
+			n_taken++;
+			actions = std::move(tmp);
+		}
+		/* nothing else should be pending */
+		if(loader.take_loaded()) {
+			fprintf(stderr, "round %d: extra version loaded\n", k);
+			errors++;
+		}
+	}
+
+	/* stop while a load is in progress; the result is discarded */
+	slow = true;
+	loader.request_load(id++);
+	std::this_thread::sleep_for(std::chrono::microseconds(200));
+	auto u = std::make_unique<UsageStats>();
+	last_saved = n_rounds + 1;
+	u->record(last_saved);
+	loader.request_save(std::move(u));
+	std::unique_ptr<UsageStats> pending = loader.stop();
+	take_errors();
+	if(n_errors != n_failed) {
+		fprintf(stderr, "%u loads failed, but %u errors were taken\n", n_failed.load(), n_errors);
+		errors++;
+	}
+	if((pending ? pending->get(last_saved) : saved.get(last_saved)) != 1.0) {
+		fprintf(stderr, "last usage counts were not saved\n");
+		errors++;
+	}
+	if(loader.running() || loader.fd() >= 0 || loader.take_loaded()) {
+		fprintf(stderr, "loader not stopped\n");
+		errors++;
+	}
+	/* a stopped loader can be started again */
+	if(!loader.start()) {
+		fprintf(stderr, "cannot restart the loader thread\n");
+		errors++;
+	}
+	loader.stop();
+
+	printf("%u requests, %u loads (%u failed), %u versions taken, %d errors\n", id - 1, n_loads.load(),
+		n_failed.load(), n_taken, errors);
+	return errors ? 1 : 0;
+}
+
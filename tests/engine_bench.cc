@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Time comparing every query with every template using each engine of
+ * Stroke::compare() (on the strokes from bench_strokes.h), and report how
+ * much the scores differ from the ones given by Engine::Exact: the largest
+ * difference among pairs that match with both, the number of pairs that
+ * match with only one of them (this happens for pairs with a cost close
+ * to stroke_infinity), and the number of queries whose best match is
+ * different.
+ * Usage: engine_bench [templates] [queries] [repeat]
+ * (default: 300 templates, 100 queries, 3 repeats)
+ * Everything is done repeat times and the fastest time is
+ * reported; the prepared versions of the strokes are created before.
+ * If built with STROKE_SIMD (meson configure -Dsimd=true), the exact
+ * engine is also timed with each kernel for the angle differences (see
+ * stroke_set_kernel()); the first line uses the one selected for the CPU. */
+
+#include "bench_strokes.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+	unsigned int n_templates = (argc > 1) ? atoi(argv[1]) : 300;
+	unsigned int n_queries = (argc > 2) ? atoi(argv[2]) : 100;
+	int repeat = (argc > 3) ? atoi(argv[3]) : 3;
+	BenchStrokes data(n_templates, n_queries);
+
+	const Stroke::Engine engines[] = { Stroke::Engine::Exact, Stroke::Engine::Fast,
+		Stroke::Engine::Quantized, Stroke::Engine::Protractor };
+	const char* engine_names[] = { "exact", "fast", "quantized", "protractor" };
+	std::vector<double> exact_scores;
+	std::vector<double> scores(data.queries.size() * data.templates.size());
+	double exact_time = 0.0;
+	printf("%zu templates, %zu queries\n", data.templates.size(), data.queries.size());
+	int n_runs = 4;
+#ifdef STROKE_SIMD
+	const char* kernel_names[] = { "exact (scalar kernel)", "exact (SSE2 kernel)", "exact (AVX2 kernel)" };
+	n_runs += 3;
+#endif
+	for(int e = 0; e < n_runs; e++) {
+		Stroke::Engine engine = (e < 4) ? engines[e] : Stroke::Engine::Exact;
+		const char* name = (e < 4) ? engine_names[e] : nullptr;
+#ifdef STROKE_SIMD
+		if(e >= 4) {
+			if(!stroke_set_kernel(e - 4)) continue;
+			name = kernel_names[e - 4];
+		}
+#endif
+		double best = -1.0;
+		for(int r = 0; r <= repeat; r++) {
+			/* the first round creates the prepared versions and is not timed */
+			auto start = std::chrono::steady_clock::now();
+			size_t k = 0;
+			for(const Stroke& q : data.queries) for(const Stroke& t : data.templates) {
+				double score;
+				if(Stroke::compare(q, t, score, stroke_infinity, engine) < 0) score = -1.0;
+				scores[k++] = score;
+			}
+			double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if(r && (best < 0.0 || t < best)) best = t;
+		}
+		if(!e) {
+			exact_scores = scores;
+			exact_time = best;
+		}
+
+		double max_diff = 0.0;
+		unsigned int n_different = 0;
+		size_t n_mismatch = 0;
+		for(size_t i = 0; i < data.queries.size(); i++) {
+			const double* x = exact_scores.data() + i * data.templates.size();
+			const double* y = scores.data() + i * data.templates.size();
+			size_t best1 = 0, best2 = 0;
+			for(size_t j = 0; j < data.templates.size(); j++) {
+				if((x[j] < 0.0) != (y[j] < 0.0)) n_mismatch++;
+				else if(x[j] >= 0.0) max_diff = std::max(max_diff, std::abs(x[j] - y[j]));
+				if(x[j] > x[best1]) best1 = j;
+				if(y[j] > y[best2]) best2 = j;
+			}
+			if(best1 != best2) n_different++;
+		}
+		printf("%s: %.3f ms (%.2fx), largest score difference: %g, %zu pairs matched by only one engine, "
+			"different best match for %u queries\n", name, best, exact_time / best, max_diff,
+			n_mismatch, n_different);
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* An IncrementalMatcher that is given the points of a gesture as they are
+ * drawn should only need to compare a few templates when it is finished,
+ * and still find the same best match as ActionListDiff::handle() for
+ * nearly all gestures. This uses the templates and queries from
+ * bench_strokes.h, with the queries drawn point by point (scaled to
+ * screen coordinates, with several points for each segment, as in
+ * alloc_test). */
+
+#include "bench_strokes.h"
+#include "actiondb.h"
+#include <cstdio>
+
+static const unsigned int n_templates = 300;
+static const unsigned int n_queries = 100;
+/* finish() should compare at most this fraction of the templates that handle() compares */
+static const double max_compared = 0.1;
+/* and find the same best match for at least this fraction of queries */
+static const double min_same = 0.9;
+
+int main() {
+	BenchStrokes data(n_templates, n_queries);
+	ActionDB actions;
+	for(size_t i = 0; i < data.templates.size(); i++) {
+		StrokeInfo info;
+		info.stroke = data.templates[i].clone();
+		info.name = "template " + std::to_string(i);
+		actions.add_stroke(actions.get_root(), std::move(info));
+	}
+	actions.build_match_tables();
+	const ActionListDiff<false>* root = actions.get_root();
+
+	int errors = 0;
+	unsigned long n_finish = 0, n_batch = 0;
+	unsigned int n_same = 0;
+	MatchOptions opts;
+	IncrementalMatcher matcher;
+	Stroke::PreStroke ps;
+	for(const Stroke& q : data.queries) {
+		ps.clear();
+		matcher.start(root, opts);
+		for(unsigned int i = 0; i + 1 < q.size(); i++) {
+			Stroke::Point a = q.points(i), b = q.points(i + 1);
+			for(unsigned int j = 0; j < 4; j++) {
+				double r = j / 4.0;
+				ps.push_back(Stroke::Point{500.0 * (a.x + r * (b.x - a.x)), 500.0 * (a.y + r * (b.y - a.y))});
+				matcher.update(ps, 1000000);
+			}
+		}
+		Stroke::Point last = q.points(q.size() - 1);
+		ps.push_back(Stroke::Point{500.0 * last.x, 500.0 * last.y});
+		Ranking r1, r2;
+		matcher.finish(ps, &r1);
+		matcher.reset();
+		root->handle(Stroke(ps), &r2, opts);
+		n_finish += r1.n_compared;
+		n_batch += r2.n_compared;
+		if(r1.id == r2.id) n_same++;
+		else if(r1.id && r1.score > r2.score) {
+			/* a different template cannot score higher than the best one */
+			fprintf(stderr, "template %u scores %g with finish(), more than the best one (%u, %g)\n",
+				r1.id, r1.score, r2.id, r2.score);
+			errors++;
+		}
+	}
+	printf("%u gestures: finish() compared %lu templates, handle() %lu; same best match for %u\n",
+		n_queries, n_finish, n_batch, n_same);
+	if(n_finish > max_compared * n_batch) {
+		fprintf(stderr, "finish() compared too many templates\n");
+		errors++;
+	}
+	if(n_same < min_same * n_queries) {
+		fprintf(stderr, "finish() found a different best match too often\n");
+		errors++;
+	}
+	return errors ? 1 : 0;
+}
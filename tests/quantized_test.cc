@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The Quantized engine (16-bit t and alpha, computing in single precision)
+ * should give nearly the same cost as stroke_compare(). The difference is
+ * typically around 1e-5; it is larger in a few cases where rounding t
+ * changes which steps of the dynamic programming are allowed, but it has
+ * to stay below max_error for all pairs. With a maximum cost, the result
+ * should be the same if it is below that, and stroke_infinity otherwise
+ * (i.e. rejecting the pair early must not change the result). */
+
+#include "stroke.h"
+#include "stroke_match.h"
+#include "reference.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using QuantizedMatcher = StrokeMatcher<float, 0, QuantizedEncoding<float>>;
+
+static constexpr int n_pairs = 20000;
+static constexpr int max_points = 80;
+/* maximum difference in the cost (the score differs by 2.5 times this) */
+static constexpr double max_error = 0.025;
+/* at least 99% of the matching pairs have to be within this */
+static constexpr double typical_error = 1e-4;
+
+static stroke_t *make_stroke(int n, const double *x, const double *y) {
+	stroke_t *s = stroke_alloc(n);
+	for (int i = 0; i < n; i++)
+		stroke_add_point(s, x[i], y[i]);
+	stroke_finish(s);
+	return s;
+}
+
+int main() {
+	unsigned int seed = 1;
+	int errors = 0;
+	std::vector<double> diff;
+	QuantizedMatcher::Prepared pa, pb;
+	for (int k = 0; k < n_pairs; k++) {
+		double xa[max_points], ya[max_points], xb[max_points], yb[max_points];
+		int M = 2 + rand_r(&seed) % (max_points - 1);
+		int N = M;
+		random_points(&seed, M, xa, ya);
+		if (k % 2) {
+			/* similar strokes, so that many pairs match */
+			for (int i = 0; i < N; i++) {
+				xb[i] = xa[i] + 2.0 * rand_r(&seed) / RAND_MAX;
+				yb[i] = ya[i] + 2.0 * rand_r(&seed) / RAND_MAX;
+			}
+		}
+		else {
+			N = 2 + rand_r(&seed) % (max_points - 1);
+			random_points(&seed, N, xb, yb);
+		}
+		stroke_t *a = make_stroke(M, xa, ya);
+		stroke_t *b = make_stroke(N, xb, yb);
+		double exact = stroke_compare(a, b, NULL, NULL);
+		double cost = 0.0;
+		if (!QuantizedMatcher::prepare(a, pa) || !QuantizedMatcher::prepare(b, pb)) {
+			if (errors < 10)
+				fprintf(stderr, "pair %d (%d x %d points): cannot prepare\n", k, M, N);
+			errors++;
+		}
+		else {
+			cost = QuantizedMatcher::compare(pa, pb);
+			if (cost < stroke_infinity) {
+				float max_cost = cost * (0.5f + 0.1f * (k % 11)); /* between 0.5 and 1.5 times the cost */
+				float bounded = QuantizedMatcher::compare(pa, pb, max_cost);
+				if (bounded != (cost <= max_cost ? cost : (float)stroke_infinity)) {
+					if (errors < 10)
+						fprintf(stderr, "pair %d (%d x %d points): cost %.9g, with maximum %.9g: %.9g\n",
+							k, M, N, cost, max_cost, bounded);
+					errors++;
+				}
+			}
+		}
+		if ((exact < stroke_infinity) != (cost < stroke_infinity) ||
+				(exact < stroke_infinity && std::abs(cost - exact) > max_error)) {
+			if (errors < 10)
+				fprintf(stderr, "pair %d (%d x %d points): cost %.9g, exact %.9g\n", k, M, N, cost, exact);
+			errors++;
+		}
+		else if (exact < stroke_infinity)
+			diff.push_back(std::abs(cost - exact));
+		stroke_free(a);
+		stroke_free(b);
+	}
+	std::sort(diff.begin(), diff.end());
+	double typical = diff.empty() ? 0.0 : diff[diff.size() * 99 / 100];
+	if (typical > typical_error) {
+		fprintf(stderr, "99%% of the differences are only within %g\n", typical);
+		errors++;
+	}
+	printf("%d pairs compared, %zu matched, largest difference %g, %d errors\n", n_pairs, diff.size(),
+		diff.empty() ? 0.0 : diff.back(), errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include "reference.h"
+#include "stroke.h"
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+
+#define EPS 0.000001
+
+static inline double sqr(double x) { return x*x; }
+
+static inline double angle_difference(double alpha, double beta) {
+	double d = alpha - beta;
+	if (d < -1.0)
+		d += 2.0;
+	else if (d > 1.0)
+		d -= 2.0;
+	return d;
+}
+
+void reference_finish(int n, const double *x0, const double *y0, double *t, double *alpha) {
+	double *x = malloc(n * sizeof(double));
+	double *y = malloc(n * sizeof(double));
+	double total = 0.0;
+	t[0] = 0.0;
+	for (int i = 0; i + 1 < n; i++) {
+		total += hypot(x0[i+1] - x0[i], y0[i+1] - y0[i]);
+		t[i+1] = total;
+	}
+	for (int i = 0; i < n; i++)
+		t[i] /= total;
+	double minX = x0[0], minY = y0[0], maxX = minX, maxY = minY;
+	for (int i = 1; i < n; i++) {
+		if (x0[i] < minX) minX = x0[i];
+		if (x0[i] > maxX) maxX = x0[i];
+		if (y0[i] < minY) minY = y0[i];
+		if (y0[i] > maxY) maxY = y0[i];
+	}
+	double scaleX = maxX - minX;
+	double scaleY = maxY - minY;
+	double scale = (scaleX > scaleY) ? scaleX : scaleY;
+	if (scale < 0.001) scale = 1;
+	for (int i = 0; i < n; i++) {
+		x[i] = (x0[i]-(minX+maxX)/2)/scale + 0.5;
+		y[i] = (y0[i]-(minY+maxY)/2)/scale + 0.5;
+	}
+	for (int i = 0; i + 1 < n; i++)
+		alpha[i] = atan2(y[i+1] - y[i], x[i+1] - x[i])/M_PI;
+	alpha[n-1] = 0.0;
+	free(y);
+	free(x);
+}
+
+static inline void step(const double *ta, const double *alpha_a, const double *tb, const double *alpha_b,
+		int N, double *dist, int x, int y, double tx, double ty, int *k, int x2, int y2) {
+	double dtx = ta[x2] - tx;
+	double dty = tb[y2] - ty;
+	if (dtx >= dty * 2.2 || dty >= dtx * 2.2 || dtx < EPS || dty < EPS)
+		return;
+	(*k)++;
+
+	double d = 0.0;
+	int i = x, j = y;
+	double next_tx = (ta[i+1] - tx) / dtx;
+	double next_ty = (tb[j+1] - ty) / dty;
+	double cur_t = 0.0;
+
+	for (;;) {
+		double ad = sqr(angle_difference(alpha_a[i], alpha_b[j]));
+		double next_t = next_tx < next_ty ? next_tx : next_ty;
+		bool done = next_t >= 1.0 - EPS;
+		if (done)
+			next_t = 1.0;
+		d += (next_t - cur_t)*ad;
+		if (done)
+			break;
+		cur_t = next_t;
+		if (next_tx < next_ty)
+			next_tx = (ta[++i+1] - tx) / dtx;
+		else
+			next_ty = (tb[++j+1] - ty) / dty;
+	}
+	double new_dist = dist[x*N+y] + d * (dtx + dty);
+	if (new_dist < dist[x2*N+y2])
+		dist[x2*N+y2] = new_dist;
+}
+
+double reference_compare(int M, const double *ta, const double *alpha_a,
+		int N, const double *tb, const double *alpha_b) {
+	const int m = M - 1;
+	const int n = N - 1;
+
+	double *dist = malloc(M * N * sizeof(double));
+	for (int i = 0; i < M * N; i++)
+		dist[i] = stroke_infinity;
+	dist[0] = 0.0;
+
+	for (int x = 0; x < m; x++) {
+		for (int y = 0; y < n; y++) {
+			if (dist[x*N+y] >= stroke_infinity)
+				continue;
+			double tx = ta[x];
+			double ty = tb[y];
+			int max_x = x;
+			int max_y = y;
+			int k = 0;
+
+			while (k < 4) {
+				if (ta[max_x+1] - tx > tb[max_y+1] - ty) {
+					max_y++;
+					if (max_y == n) {
+						step(ta, alpha_a, tb, alpha_b, N, dist, x, y, tx, ty, &k, m, n);
+						break;
+					}
+					for (int x2 = x+1; x2 <= max_x; x2++)
+						step(ta, alpha_a, tb, alpha_b, N, dist, x, y, tx, ty, &k, x2, max_y);
+				} else {
+					max_x++;
+					if (max_x == m) {
+						step(ta, alpha_a, tb, alpha_b, N, dist, x, y, tx, ty, &k, m, n);
+						break;
+					}
+					for (int y2 = y+1; y2 <= max_y; y2++)
+						step(ta, alpha_a, tb, alpha_b, N, dist, x, y, tx, ty, &k, max_x, y2);
+				}
+			}
+		}
+	}
+	double cost = dist[M*N-1];
+	free(dist);
+	return cost;
+}
+
+void random_points(unsigned int *seed, int n, double *x, double *y) {
+	double a = 6.283 * rand_r(seed) / RAND_MAX;
+	double px = 100.0 * rand_r(seed) / RAND_MAX;
+	double py = 100.0 * rand_r(seed) / RAND_MAX;
+	for (int i = 0; i < n; i++) {
+		/* repeated points give zero length segments */
+		if (i < 2 || rand_r(seed) % 16) {
+			a += 1.5 * ((double)rand_r(seed) / RAND_MAX - 0.5);
+			double len = 1.0 + 10.0 * rand_r(seed) / RAND_MAX;
+			px += len * cos(a);
+			py += len * sin(a);
+		}
+		x[i] = px;
+		y[i] = py;
+	}
+}
+
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __REFERENCE_H__
+#define __REFERENCE_H__
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* The original (Easystroke) version of the stroke matching code, kept
+ * here in a simple form to test the optimized one in stroke.c against. */
+
+/* Compute the parameter (t) and direction (alpha) of each of the n points
+ * in the same way as the original stroke_finish(), using libm. */
+void reference_finish(int n, const double *x, const double *y, double *t, double *alpha);
+
+/* Matching cost of two strokes with the original dynamic programming over
+ * the full table; a has M points and b has N points. */
+double reference_compare(int M, const double *ta, const double *alpha_a,
+	int N, const double *tb, const double *alpha_b);
+
+/* Generate a random stroke of n points (a random walk with smoothly
+ * changing direction, sometimes repeating a point). */
+void random_points(unsigned int *seed, int n, double *x, double *y);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
+
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Gestures with several samples keep their main stroke and spread when
+ * saved and loaded again, and when compacted; this matters for gestures
+ * where the main stroke is not the medoid (e.g. ones imported from
+ * Easystroke, where the first stroke stays the main one). Also checks
+ * that the search for duplicates can be cancelled.
+ * Usage: samples_test actions_file temporary_file */
+
+#include "actiondb.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+/* points are normalized again when loading, which can change their
+ * last digits, so they are compared with this tolerance */
+static const double point_tolerance = 1e-12;
+
+static bool same_point(const Stroke::Point& p, const Stroke::Point& q) {
+	return std::abs(p.x - q.x) <= point_tolerance && std::abs(p.y - q.y) <= point_tolerance;
+}
+
+static bool same_stroke(const Stroke& a, const Stroke& b) {
+	if(a.size() != b.size()) return false;
+	for(unsigned int i = 0; i < a.size(); i++)
+		if(!same_point(a.points(i), b.points(i))) return false;
+	return true;
+}
+
+/* check that the gestures in b have the same main stroke, samples and
+ * spread as the ones in a (spread is only compared if check_spread is true) */
+static int compare_infos(const ActionDB& a, const ActionDB& b, const char* what, bool check_spread) {
+	int errors = 0;
+	auto x = a.get_root()->get_stroke_infos();
+	auto y = b.get_root()->get_stroke_infos();
+	if(x.size() != y.size()) {
+		fprintf(stderr, "%s: %zu gestures instead of %zu\n", what, y.size(), x.size());
+		return 1;
+	}
+	for(const auto& p : x) {
+		auto it = y.find(p.first);
+		if(it == y.end()) {
+			fprintf(stderr, "%s: gesture %u missing\n", what, p.first);
+			errors++;
+			continue;
+		}
+		const StrokeInfo& i1 = *p.second;
+		const StrokeInfo& i2 = *it->second;
+		bool same = same_stroke(i1.stroke, i2.stroke) && i1.samples.size() == i2.samples.size();
+		for(size_t j = 0; same && j < i1.samples.size(); j++) same = same_stroke(i1.samples[j], i2.samples[j]);
+		if(!same) {
+			fprintf(stderr, "%s: gesture %u has a different main stroke or samples\n", what, p.first);
+			errors++;
+		}
+		else if(check_spread && std::abs(i1.spread - i2.spread) > 1e-12) {
+			fprintf(stderr, "%s: gesture %u has spread %g instead of %g\n", what, p.first, i2.spread, i1.spread);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char** argv) {
+	if(argc < 3) {
+		fprintf(stderr, "Usage: %s actions_file temporary_file\n", argv[0]);
+		return 1;
+	}
+	ActionDB actions;
+	if(!actions.read(argv[1], false)) {
+		fprintf(stderr, "Cannot read %s\n", argv[1]);
+		return 1;
+	}
+
+	/* add gestures with noisy samples of existing ones; the first of
+	 * these is the noisiest, so it is not the medoid */
+	std::mt19937 gen(1);
+	std::vector<const Stroke*> templates;
+	for(const auto& x : actions.get_root()->get_strokes()) if(!x.second->trivial()) templates.push_back(x.second);
+	std::vector<StrokeInfo> infos;
+	for(size_t k = 0; k < templates.size(); k++) {
+		std::vector<Stroke> all;
+		for(int j = 0; j < 4; j++) {
+			std::normal_distribution<double> noise(0.0, j ? 0.005 : 0.03);
+			Stroke::PreStroke ps;
+			for(unsigned int i = 0; i < templates[k]->size(); i++) {
+				Stroke::Point p = templates[k]->points(i);
+				ps.push_back(Stroke::Point{p.x + noise(gen), p.y + noise(gen)});
+			}
+			all.emplace_back(ps);
+		}
+		StrokeInfo info;
+		info.set_samples(std::move(all), true);
+		info.name = "samples " + std::to_string(k);
+		infos.push_back(std::move(info));
+	}
+	for(auto& x : infos) actions.add_stroke(actions.get_root(), std::move(x));
+
+	int errors = 0;
+	actions.write(argv[2]);
+	ActionDB loaded;
+	if(!loaded.read(argv[2], false)) {
+		fprintf(stderr, "Cannot read %s\n", argv[2]);
+		return 1;
+	}
+	errors += compare_infos(actions, loaded, "saved and loaded", true);
+
+	/* compacting keeps the main stroke (only its points change) */
+	loaded.compact_strokes(0.99);
+	for(const auto& x : loaded.get_root()->get_stroke_infos()) {
+		const StrokeInfo& orig = *actions.get_root()->get_stroke_infos().at(x.first);
+		if(x.second->samples.size() != orig.samples.size()) {
+			fprintf(stderr, "compacted: gesture %u lost samples\n", x.first);
+			errors++;
+		}
+		/* the main stroke should still be the simplified version of the
+		 * original one (which is the noisiest one), i.e. closest to it */
+		else if(!orig.samples.empty()) {
+			double score, best = -1.0;
+			Stroke::compare(x.second->stroke, orig.stroke, score);
+			for(const Stroke& y : orig.samples) {
+				double s2;
+				Stroke::compare(x.second->stroke, y, s2);
+				best = std::max(best, s2);
+			}
+			if(score <= best) {
+				fprintf(stderr, "compacted: gesture %u has a different main stroke\n", x.first);
+				errors++;
+			}
+		}
+	}
+
+	/* saving again after compacting keeps everything as well */
+	loaded.write(argv[2]);
+	ActionDB loaded2;
+	if(!loaded2.read(argv[2], false)) {
+		fprintf(stderr, "Cannot read %s\n", argv[2]);
+		return 1;
+	}
+	errors += compare_infos(loaded, loaded2, "compacted, saved and loaded", true);
+	remove(argv[2]);
+	
+	/* the duplicate search reports its progress and can be cancelled,
+	 * returning the pairs found until then */
+	auto dups = loaded2.find_duplicates(0.9);
+	double last = -1.0;
+	unsigned int calls = 0;
+	auto dups2 = loaded2.find_duplicates(0.9, [&] (double x) {
+		if(x < last || x > 1.0) errors++;
+		last = x;
+		return ++calls < 10;
+	});
+	if(dups2.size() > dups.size() || !std::equal(dups2.begin(), dups2.end(), dups.begin(),
+			[] (const auto& x, const auto& y) { return x.id1 == y.id1 && x.id2 == y.id2; })) {
+		fprintf(stderr, "cancelled duplicate search: %zu pairs do not match the first %zu\n", dups2.size(), dups.size());
+		errors++;
+	}
+
+	printf("%zu gestures with samples, %d errors\n", templates.size(), errors);
+	return errors ? 1 : 0;
+}
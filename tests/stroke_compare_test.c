@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The dynamic programming in stroke_compare() only stores a corridor of
+ * the table and can stop early, but it should give exactly the same
+ * result as the original version (for the same t and alpha values).
+ * With STROKE_SIMD, this is checked with each kernel for computing the
+ * angle differences that the CPU supports. Ranking templates with
+ * stroke_compare_many() should order them by decreasing score, and by
+ * index for the same score. */
+
+#define _GNU_SOURCE
+
+#include "stroke.h"
+#include "reference.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_PAIRS 20000
+#define MAX_POINTS 80
+#define N_TEMPLATES 500
+
+static stroke_t *make_stroke(int n, const double *x, const double *y, double *t, double *alpha) {
+	stroke_t *s = stroke_alloc(n);
+	for (int i = 0; i < n; i++)
+		stroke_add_point(s, x[i], y[i]);
+	stroke_finish(s);
+	for (int i = 0; i < n; i++) {
+		t[i] = stroke_get_time(s, i);
+		alpha[i] = (i + 1 < n) ? stroke_get_angle(s, i) : 0.0;
+	}
+	return s;
+}
+
+/* compare random pairs of strokes with the reference; returns the number of errors */
+static int compare_pairs(stroke_compare_ctx_t *ctx, int *matched) {
+	unsigned int seed = 1;
+	int errors = 0;
+	int path_x[2 * MAX_POINTS], path_y[2 * MAX_POINTS];
+	*matched = 0;
+	for (int k = 0; k < N_PAIRS; k++) {
+		double ta[MAX_POINTS], alpha_a[MAX_POINTS], tb[MAX_POINTS], alpha_b[MAX_POINTS];
+		double xa[MAX_POINTS], ya[MAX_POINTS], xb[MAX_POINTS], yb[MAX_POINTS];
+		int M = 2 + rand_r(&seed) % (MAX_POINTS - 1);
+		int N = M;
+		random_points(&seed, M, xa, ya);
+		if (k % 2) {
+			/* similar strokes, so that many pairs match */
+			for (int i = 0; i < N; i++) {
+				xb[i] = xa[i] + 2.0 * rand_r(&seed) / RAND_MAX;
+				yb[i] = ya[i] + 2.0 * rand_r(&seed) / RAND_MAX;
+			}
+		}
+		else {
+			N = 2 + rand_r(&seed) % (MAX_POINTS - 1);
+			random_points(&seed, N, xb, yb);
+		}
+		stroke_t *a = make_stroke(M, xa, ya, ta, alpha_a);
+		stroke_t *b = make_stroke(N, xb, yb, tb, alpha_b);
+		double ref = reference_compare(M, ta, alpha_a, N, tb, alpha_b);
+		if (ref < stroke_infinity)
+			(*matched)++;
+
+		double cost = stroke_compare(a, b, NULL, NULL);
+		double cost_ctx = stroke_compare_ctx(ctx, a, b, NULL, NULL);
+		double cost_path = stroke_compare_ctx(ctx, a, b, path_x, path_y);
+		if (cost != ref || cost_ctx != ref || cost_path != ref) {
+			if (errors < 10)
+				fprintf(stderr, "pair %d (%d x %d points): cost %.17g, reference %.17g\n", k, M, N, cost, ref);
+			errors++;
+		}
+
+		/* with a bound, the result is the same if it is within the bound */
+		double max_cost = stroke_infinity * rand_r(&seed) / RAND_MAX;
+		double bounded = stroke_compare_ctx_bounded(ctx, a, b, max_cost);
+		if (bounded != ((ref <= max_cost) ? ref : stroke_infinity)) {
+			if (errors < 10)
+				fprintf(stderr, "pair %d: bounded cost %.17g with max_cost %.17g, reference %.17g\n",
+					k, bounded, max_cost, ref);
+			errors++;
+		}
+		stroke_free(a);
+		stroke_free(b);
+	}
+	return errors;
+}
+
+int main(void) {
+	unsigned int seed = 2;
+	int errors = 0;
+	int matched = 0;
+	stroke_compare_ctx_t *ctx = stroke_compare_ctx_alloc();
+#ifdef STROKE_SIMD
+	for (int kernel = 0; kernel < 3; kernel++) {
+		if (!stroke_set_kernel(kernel)) {
+			printf("kernel %d is not supported\n", kernel);
+			continue;
+		}
+		int e = compare_pairs(ctx, &matched);
+		printf("kernel %d: %d errors\n", kernel, e);
+		errors += e;
+	}
+#else
+	errors += compare_pairs(ctx, &matched);
+#endif
+
+	/* the templates are noisy copies of a few strokes, with some of them
+	 * repeated exactly, so that there are many ties */
+	stroke_t *templates[N_TEMPLATES];
+	stroke_score_t scores[N_TEMPLATES];
+	double base_x[4][MAX_POINTS], base_y[4][MAX_POINTS];
+	for (int j = 0; j < 4; j++)
+		random_points(&seed, MAX_POINTS / 2, base_x[j], base_y[j]);
+	for (int i = 0; i < N_TEMPLATES; i++) {
+		if (i % 5 == 4) {
+			templates[i] = stroke_copy(templates[rand_r(&seed) % i]);
+			continue;
+		}
+		double x[MAX_POINTS], y[MAX_POINTS], t[MAX_POINTS], alpha[MAX_POINTS];
+		const double *bx = base_x[i % 4], *by = base_y[i % 4];
+		for (int j = 0; j < MAX_POINTS / 2; j++) {
+			x[j] = bx[j] + 2.0 * rand_r(&seed) / RAND_MAX;
+			y[j] = by[j] + 2.0 * rand_r(&seed) / RAND_MAX;
+		}
+		templates[i] = make_stroke(MAX_POINTS / 2, x, y, t, alpha);
+	}
+	stroke_compare_many_ctx(ctx, templates[0], (const stroke_t *const *)templates, N_TEMPLATES, scores,
+		STROKE_COMPARE_RANK);
+	char seen[N_TEMPLATES] = {0};
+	for (int r = 0; r < N_TEMPLATES; r++) {
+		int i = scores[r].order;
+		if (i < 0 || i >= N_TEMPLATES || seen[i]) {
+			fprintf(stderr, "rank %d: invalid or repeated template %d\n", r, i);
+			errors++;
+			break;
+		}
+		seen[i] = 1;
+		if (r > 0) {
+			int j = scores[r-1].order;
+			if (scores[j].score < scores[i].score || (scores[j].score == scores[i].score && j > i)) {
+				fprintf(stderr, "rank %d: template %d (score %g) after %d (score %g)\n",
+					r, i, scores[i].score, j, scores[j].score);
+				errors++;
+			}
+		}
+	}
+	for (int i = 0; i < N_TEMPLATES; i++)
+		stroke_free(templates[i]);
+
+	stroke_compare_ctx_free(ctx);
+	printf("%d pairs compared, %d matched, %d templates ranked, %d errors\n", N_PAIRS, matched, N_TEMPLATES, errors);
+	return errors ? 1 : 0;
+}
+
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2023, Daniel Kondor <kondor.dani@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* stroke_finish() uses a polynomial approximation of atan2() (atan2_pi())
+ * and computes t and alpha in fewer passes than the original version.
+ * Check that atan2_pi() is within its documented error bound of libm's
+ * atan2(), and that the results of stroke_finish(), as well as the
+ * matching costs computed from them, stay close to the original ones. */
+
+#define _GNU_SOURCE
+
+/* included directly, so that atan2_pi() (a static function) can be tested */
+#include "stroke.c"
+#include "reference.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_ANGLES 2000000
+#define N_STROKES 20000
+#define MAX_POINTS 80
+
+/* bound given in the description of atan2_pi() */
+#define MAX_ANGLE_ERROR 1e-14
+/* In stroke_finish(), the points are normalized in a different order
+ * than originally before computing the angles. This changes the rounding
+ * of the coordinates (by a few units in the last place), which changes
+ * the angle of a segment by at most about ROUNDING_ERROR / its length
+ * (relative to the size of the stroke), in addition to MAX_ANGLE_ERROR. */
+#define ROUNDING_ERROR 1e-15
+#define MAX_T_ERROR 1e-15
+#define MAX_COST_ERROR 1e-12
+
+static double random_coordinate(unsigned int *seed) {
+	return ldexp(2.0 * rand_r(seed) / RAND_MAX - 1.0, rand_r(seed) % 40 - 20);
+}
+
+static int check_angles(void) {
+	unsigned int seed = 1;
+	int errors = 0;
+	double max_error = 0.0;
+	for (int k = 0; k < N_ANGLES; k++) {
+		double x = random_coordinate(&seed);
+		double y = random_coordinate(&seed);
+		/* special directions */
+		if (k % 13 == 0)
+			x = 0.0;
+		if (k % 17 == 0)
+			y = 0.0;
+		if (k % 19 == 0)
+			y = x;
+		if (k % 23 == 0)
+			y = -x;
+		if (x == 0.0 && y == 0.0)
+			continue;
+		double error = fabs(atan2_pi(y, x) - atan2(y, x) / M_PI);
+		if (error > max_error)
+			max_error = error;
+		if (error > MAX_ANGLE_ERROR) {
+			if (errors < 10)
+				fprintf(stderr, "atan2_pi(%.17g, %.17g): error %g\n", y, x, error);
+			errors++;
+		}
+	}
+	printf("atan2_pi(): largest error %g\n", max_error);
+	return errors;
+}
+
+static stroke_t *make_stroke(int n, const double *x, const double *y, double *t, double *alpha) {
+	stroke_t *s = stroke_alloc(n);
+	for (int i = 0; i < n; i++)
+		stroke_add_point(s, x[i], y[i]);
+	stroke_finish(s);
+	for (int i = 0; i < n; i++) {
+		t[i] = stroke_get_time(s, i);
+		alpha[i] = (i + 1 < n) ? stroke_get_angle(s, i) : 0.0;
+	}
+	return s;
+}
+
+/* compare the values from stroke_finish() to the original ones */
+static int check_finish(int n, const double *x, const double *y, const double *t, const double *alpha,
+		const double *t_ref, const double *alpha_ref, double *max_t, double *max_alpha) {
+	double min_x = x[0], max_x = x[0], min_y = y[0], max_y = y[0];
+	for (int i = 1; i < n; i++) {
+		min_x = fmin(min_x, x[i]);
+		max_x = fmax(max_x, x[i]);
+		min_y = fmin(min_y, y[i]);
+		max_y = fmax(max_y, y[i]);
+	}
+	double size = fmax(max_x - min_x, max_y - min_y);
+	int errors = 0;
+	for (int i = 0; i < n; i++) {
+		double len = (i + 1 < n) ? hypot(x[i+1] - x[i], y[i+1] - y[i]) / size : 0.0;
+		double max_error = (len > 0.0) ? MAX_ANGLE_ERROR + ROUNDING_ERROR / len : 0.0;
+		double dt = fabs(t[i] - t_ref[i]);
+		double da = fabs(alpha[i] - alpha_ref[i]);
+		/* -1 and 1 are the same direction */
+		if (da > 1.0)
+			da = 2.0 - da;
+		if (dt > *max_t)
+			*max_t = dt;
+		if (da > *max_alpha)
+			*max_alpha = da;
+		if (dt > MAX_T_ERROR || da > max_error)
+			errors++;
+	}
+	return errors;
+}
+
+static int check_strokes(void) {
+	unsigned int seed = 2;
+	int errors = 0;
+	double max_t = 0.0, max_alpha = 0.0, max_cost = 0.0;
+	for (int k = 0; k < N_STROKES; k++) {
+		double xa[MAX_POINTS], ya[MAX_POINTS], xb[MAX_POINTS], yb[MAX_POINTS];
+		double ta[MAX_POINTS], alpha_a[MAX_POINTS], tb[MAX_POINTS], alpha_b[MAX_POINTS];
+		double ta_ref[MAX_POINTS], alpha_a_ref[MAX_POINTS], tb_ref[MAX_POINTS], alpha_b_ref[MAX_POINTS];
+		int M = 2 + rand_r(&seed) % (MAX_POINTS - 1);
+		int N = M;
+		random_points(&seed, M, xa, ya);
+		if (k % 2) {
+			/* similar strokes, so that many pairs match */
+			for (int i = 0; i < N; i++) {
+				xb[i] = xa[i] + 2.0 * rand_r(&seed) / RAND_MAX;
+				yb[i] = ya[i] + 2.0 * rand_r(&seed) / RAND_MAX;
+			}
+		}
+		else {
+			N = 2 + rand_r(&seed) % (MAX_POINTS - 1);
+			random_points(&seed, N, xb, yb);
+		}
+		stroke_t *a = make_stroke(M, xa, ya, ta, alpha_a);
+		stroke_t *b = make_stroke(N, xb, yb, tb, alpha_b);
+		reference_finish(M, xa, ya, ta_ref, alpha_a_ref);
+		reference_finish(N, xb, yb, tb_ref, alpha_b_ref);
+		int e = check_finish(M, xa, ya, ta, alpha_a, ta_ref, alpha_a_ref, &max_t, &max_alpha) +
+			check_finish(N, xb, yb, tb, alpha_b, tb_ref, alpha_b_ref, &max_t, &max_alpha);
+		if (e) {
+			if (errors < 10)
+				fprintf(stderr, "pair %d: t or alpha differs from the original\n", k);
+			errors++;
+		}
+
+		double cost = stroke_compare(a, b, NULL, NULL);
+		double ref = reference_compare(M, ta_ref, alpha_a_ref, N, tb_ref, alpha_b_ref);
+		if ((cost < stroke_infinity) != (ref < stroke_infinity) ||
+				(ref < stroke_infinity && fabs(cost - ref) > MAX_COST_ERROR)) {
+			if (errors < 10)
+				fprintf(stderr, "pair %d (%d x %d points): cost %.17g, original %.17g\n", k, M, N, cost, ref);
+			errors++;
+		}
+		else if (ref < stroke_infinity && fabs(cost - ref) > max_cost)
+			max_cost = fabs(cost - ref);
+		stroke_free(a);
+		stroke_free(b);
+	}
+	printf("stroke_finish(): largest difference in t %g, alpha %g, cost %g\n", max_t, max_alpha, max_cost);
+	return errors;
+}
+
+int main(void) {
+	int errors = check_angles() + check_strokes();
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}